@@ -0,0 +1,9 @@
+#include <time.h>
+#include "Clock.h"
+
+long long monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
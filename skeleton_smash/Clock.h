@@ -0,0 +1,7 @@
+#ifndef SMASH_CLOCK_H_
+#define SMASH_CLOCK_H_
+
+// The one clock smash measures durations with: timeouts, time, parallel, quit term and the stats counters.
+long long monotonicNs(); // CLOCK_MONOTONIC, in ns
+
+#endif //SMASH_CLOCK_H_
@@ -1,13 +1,27 @@
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <cstddef>
+#include <climits>
 #include <iostream>
 #include <fcntl.h>
 #include <vector>
 #include <sstream>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <iomanip>
+#include <fstream>
 #include "Commands.h"
 #include "Exceptions.h"
+#include "Spawn.h"
+#include "Parser.h"
+#include "EventLoop.h"
+#include "Stats.h"
+#include "Clock.h"
+#include "LineReader.h"
 
 using namespace std;
 
@@ -22,9 +36,13 @@ using namespace std;
 #define FUNC_EXIT()
 #endif
 
-#define READ_BUFFER_SIZE 4096
+#define READ_BUFFER_SIZE (128 * 1024)
+#define ZERO_COPY_CHUNK (1 << 30)
 
 const std::string WHITESPACE = " \n\r\t\f\v";
+// Characters that only bash knows how to interpret (globs, quotes, expansions, sub-shells, && lists, etc.)
+// A trailing background & is its own token and never part of the exec text.
+const std::string BASH_SPECIAL = "*?[]{}~$`'\"\\;()<!#&";
 
 string _ltrim(const std::string &s)
 {
@@ -43,483 +61,382 @@ string _trim(const std::string &s)
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char *cmd_line, char **args)
+/**
+ * Returns true if the command line contains syntax which must be handed to bash (globs, quotes,
+ * variables, sub-shells, leading variable assignments, etc.), false if it can be exec'ed directly.
+ */
+bool _isComplexCommand(const std::string& cmd_line)
 {
-    FUNC_ENTRY()
-    int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for (std::string s; iss >> s;)
+    if(cmd_line.find_first_of(BASH_SPECIAL) != std::string::npos)
     {
-        args[i] = (char *)malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = NULL;
+        return true;
     }
-    return i; 
+    std::string trimmed = _trim(cmd_line);
+    std::string first_word = trimmed.substr(0, trimmed.find_first_of(WHITESPACE));
+    return first_word.find('=') != std::string::npos; // "VAR=value cmd" style assignment
+}
 
-    FUNC_EXIT()
-} 
+bool SmallShell::isPwdSet() const
+{
+    return last_pwd.empty();
+}
+
+void SmallShell::setLastPwd(const std::string& new_pwd)
+{
+    last_pwd = new_pwd;
+}
+
+const std::string& SmallShell::getLastPwd() const
+{
+    return last_pwd;
+}
 
-// Processes the command line, estimates the type of the command and returns it.
-// Fills the args array with malloc'ed C type strings of the arguments, after seperating the operators.
-// If args_count is given, put the number of total arguments inside of it (including a NULL argument).
-CMD_Type _processCommandLine(const char* cmd_line, char** args = nullptr, int* args_count = nullptr)
+//*************BUILTIN FACTORIES*************//
+// Each factory validates the builtin's arguments (throwing the matching CmdError) and creates the command.
+static Command* _createChprompt(const CommandLine& cmd_line)
 {
-    CMD_Type res = CMD_Type::Normal;
-    std::string cmd(cmd_line);
-    std::size_t pos = cmd.find_first_of(">|"); 
-    if(pos != std::string::npos)
+    return new ChpromptCommand(cmd_line);
+}
+
+static Command* _createQuit(const CommandLine& cmd_line)
+{
+    long long grace_ns = 0;
+    if(cmd_line.argEquals(1, "term") && cmd_line.argsCount() > 2 && !extractDuration(cmd_line.argString(2), &grace_ns))
     {
-        char oper[2];
-        char half1[COMMAND_ARGS_MAX_LENGTH], half2[COMMAND_ARGS_MAX_LENGTH];
-        oper[1] = 0;
-        int n1, n2;
-        switch(cmd[pos])
-        {
-            case '>':
-            {
-                oper[0] = '>';
-                if(cmd[pos+1] == '>')
-                {
-                    oper[1] = '>';
-                    res = CMD_Type::OutAppend;
-                    goto DoubleOp;
-                }
-                else
-                {
-                    res = CMD_Type::OutRed;
-                    goto SingleOp;
-                }
-                break;
-            }
-            case '|':
-            {
-                oper[0] = '|';
-                if(cmd[pos+1] == '&')
-                {
-                    oper[1] = '&';
-                    res = CMD_Type::ErrPipe;
-                    goto DoubleOp;
-                }
-                else
-                {
-                    res = CMD_Type::Pipe;
-                    goto SingleOp;
-                }
-                break;
-            }
-            default: // Should not get here
-                break;
-        }
+        throw InvalidArgs("quit");
+    }
+    return new QuitCommand(cmd_line, SmallShell::getInstance().getJobsList());
+}
 
-    DoubleOp:
-        if(args)
-        {
-            for(unsigned i = 0; i < pos; i++)
-            {
-                half1[i] = cmd_line[i];
-            }
-            half1[pos] = 0; // Copy first half command
-            strcpy(half2, cmd_line + pos + 2); // Copy second half command
-            n1 = _parseCommandLine(half1, args); // Load first half to args arr
-            args[n1] = (char*)malloc(3 * sizeof(char)); 
-            *args[n1] = oper[0]; 
-            *(args[n1] + 1) = oper[1]; 
-            *(args[n1] + 2) = 0; // Load two operators to the next args block
-            n2 = _parseCommandLine(half2, args + n1 + 1); // Load second half to args arr
-        }
-        goto End;
+static Command* _createShowPid(const CommandLine& cmd_line)
+{
+    return new ShowPidCommand(cmd_line);
+}
 
-    SingleOp:
-        if(args)
-        {
-            for(unsigned i = 0; i < pos; i++)
-            {
-                half1[i] = cmd_line[i];
-            }
-            half1[pos] = 0; // Copy first half command
-            strcpy(half2, cmd_line + pos + 1); // Copy second half command
-            n1 = _parseCommandLine(half1, args); // Load first half to args arr
-            args[n1] = (char*)malloc(2 * sizeof(char));
-            *args[n1] = oper[0];
-            *(args[n1] + 1) = 0; // Load two operators to the next args block
-            n2 = _parseCommandLine(half2, args + n1 + 1); // Load second half to args arr
-        }
-        goto End;
+static Command* _createPwd(const CommandLine& cmd_line)
+{
+    return new GetCurrDirCommand(cmd_line);
+}
+
+static Command* _createJobs(const CommandLine& cmd_line)
+{
+    return new JobsCommand(cmd_line, SmallShell::getInstance().getJobsList());
+}
+
+static const struct
+{
+    const char* name;
+    int signum;
+} SIGNAL_NAMES[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+    {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}
+};
 
-    End:
-        if(args_count && args)
+/**
+ * Extracts a signal given as "-<number>", "-<NAME>" or "-SIG<NAME>". Returns false if the format is invalid.
+ */
+static bool _extractSignal(const std::string& str, int* signum)
+{
+    if(extractIntFlag(str, signum))
+    {
+        return true;
+    }
+    std::string name = (str.compare(0, 4, "-SIG") == 0)? str.substr(4) : str.substr(1);
+    for(auto& entry : SIGNAL_NAMES)
+    {
+        if(str[0] == '-' && name == entry.name)
         {
-            *args_count = n1 + n2 + 1;
+            *signum = entry.signum;
+            return true;
         }
     }
-    else // No special operator
+    return false;
+}
+
+/**
+ * Parses a comma separated list of jobs: "[%]<id>", "[%]<first>-<last>", "@running", "@stopped" or "@all".
+ * Every plain id must be an existing job. Returns false if the format is invalid.
+ */
+static bool _extractJobRanges(const std::string& str, std::vector<JobRange>& ranges)
+{
+    std::istringstream list(str);
+    std::string item;
+    while(std::getline(list, item, ','))
     {
-        if(_isBackgroundCommand(cmd_line)) // Insert the args after removing the ampersand.
+        JobRange range = {1, INT_MAX, true, RUNNING};
+        if(item == "@running" || item == "@stopped")
         {
-            char copy[COMMAND_ARGS_MAX_LENGTH];
-            strcpy(copy, cmd_line);
-            _removeBackgroundSign(copy);
-            if(args)
-            {
-                int n = _parseCommandLine(copy, args);
-                if(args_count) 
-                {
-                    *args_count = n;
-                }
-            }
-            res = CMD_Type::Background;
+            range.any_state = false;
+            range.state = (item == "@running")? RUNNING : STOPPED;
         }
-        else
+        else if(item != "@all")
         {
-            if(args)
+            std::string ids = (!item.empty() && item[0] == '%')? item.substr(1) : item;
+            std::size_t dash = ids.find('-', 1);
+            std::string first = ids.substr(0, dash), last = (dash == std::string::npos)? first : ids.substr(dash + 1);
+            bool unsigned_ids = (dash != std::string::npos); // A plain id may be negative, it then does not exist.
+            if(first.empty() || last.empty() || first == "-" || !isNumber(first, unsigned_ids) ||
+                !isNumber(last, unsigned_ids) || first.size() > 9 || last.size() > 9)
             {
-                int n = _parseCommandLine(cmd_line, args);
-                if(args_count) 
-                {
-                    *args_count = n;
-                }
+                return false;
+            }
+            range.first_id = std::stoi(first);
+            range.last_id = std::stoi(last);
+            if(dash == std::string::npos && !SmallShell::getInstance().getJobsList()->getJobById(range.first_id))
+            {
+                throw JobDoesNotExist("kill", range.first_id);
             }
         }
+        ranges.push_back(range);
     }
-    return res;
+    return !ranges.empty();
 }
 
-bool _isBackgroundCommand(const char *cmd_line)
+static Command* _createKill(const CommandLine& cmd_line)
 {
-    const string str(cmd_line);
-    return str[str.find_last_not_of(WHITESPACE)] == '&';
+    if(cmd_line.argsCount() < 3 || cmd_line.argLength(1) < 2) // Check correctness of the arguments
+    {
+        throw InvalidArgs("kill");
+    }
+    int signum = 0;
+    if(!_extractSignal(cmd_line.argString(1), &signum)) // Check and extract the flag arg
+    {
+        throw InvalidArgs("kill");
+    }
+    bool by_group = cmd_line.argEquals(2, "-g");
+    std::size_t first_target = by_group? 3 : 2;
+    std::vector<JobRange> targets;
+    if(first_target >= cmd_line.argsCount())
+    {
+        throw InvalidArgs("kill");
+    }
+    for(std::size_t i = first_target; i < cmd_line.argsCount(); i++)
+    {
+        if(!_extractJobRanges(cmd_line.argString(i), targets))
+        {
+            throw InvalidArgs("kill");
+        }
+    }
+    return new KillCommand(cmd_line, signum, by_group, targets, SmallShell::getInstance().getJobsList());
 }
 
-void _removeBackgroundSign(char *cmd_line)
+static Command* _createCd(const CommandLine& cmd_line)
 {
-    const string str(cmd_line);
-    // find last character other than spaces
-    unsigned int idx = str.find_last_not_of(WHITESPACE);
-    // if all characters are spaces then return
-    if (idx == string::npos)
+    std::size_t args_num = cmd_line.argsCount();
+    if (args_num > 2)
     {
-        return;
+        throw TooManyArgs("cd");
     }
-    // if the command line does not end with & then return
-    if (cmd_line[idx] != '&')
+    else if (args_num==2)
     {
-        return;
+        if (SmallShell::getInstance().getLastPwd().empty() && cmd_line.argEquals(1, "-"))
+        {
+            throw OldPwdNotSet("cd");
+        }
+        return new ChangeDirCommand(cmd_line);
     }
-    // replace the & (background sign) with space and then remove all tailing spaces.
-    cmd_line[idx] = ' ';
-    // truncate the command line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+    return nullptr;
 }
 
-bool SmallShell::isPwdSet() const
+static Command* _createCat(const CommandLine& cmd_line)
 {
-    return last_pwd.empty();
+    if(cmd_line.argsCount() < 2)
+    {
+        throw NotEnoughArgs("cat");
+    }
+    return new CatCommand(cmd_line);
 }
 
-void SmallShell::setLastPwd(const std::string& new_pwd)
+static Command* _createStats(const CommandLine& cmd_line)
 {
-    last_pwd = new_pwd;
+    if(cmd_line.argsCount() > 2 || (cmd_line.argsCount() == 2 && !cmd_line.argEquals(1, "-v") && !cmd_line.argEquals(1, "reset")))
+    {
+        throw InvalidArgs("stats");
+    }
+    return new StatsCommand(cmd_line);
 }
 
-const std::string& SmallShell::getLastPwd() const
+static Command* _createParallel(const CommandLine& cmd_line)
 {
-    return last_pwd;
+    std::size_t first = 1;
+    unsigned int max_running = 0;
+    if(cmd_line.argEquals(1, "-j"))
+    {
+        if(cmd_line.argsCount() < 3 || !isNumber(cmd_line.argString(2), true) || cmd_line.argLength(2) == 0)
+        {
+            throw InvalidArgs("parallel");
+        }
+        max_running = std::stoul(cmd_line.argString(2));
+        if(max_running == 0)
+        {
+            throw InvalidArgs("parallel");
+        }
+        first = 3;
+    }
+    if(cmd_line.argsCount() <= first)
+    {
+        throw NotEnoughArgs("parallel");
+    }
+    if(cmd_line.argEquals(first, "-f") && cmd_line.argsCount() != first + 2)
+    {
+        throw InvalidArgs("parallel");
+    }
+    if(max_running == 0) // Default: one running command per online CPU.
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_running = (cpus > 0)? cpus : 1;
+    }
+    return new ParallelCommand(cmd_line, max_running);
 }
 
-/**
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
-*/
-Command* SmallShell::CreateCommand(const char *cmd_line, bool valid_job, bool to_wait)
+static Command* _createFg(const CommandLine& cmd_line)
 {
-    char *args[COMMAND_MAX_ARGS];
-    int args_num;
-    CMD_Type type = _processCommandLine(cmd_line, args, &args_num);
-    std::string first_arg(args[0]);
-
-    switch(type)
+    std::size_t args_num = cmd_line.argsCount();
+    if (args_num > 1)
     {
-        case CMD_Type::Normal:
+        int job_id;
+        std::istringstream arg2(cmd_line.argString(1));
+        
+        if(!isNumber(cmd_line.argString(1), false) || args_num > 2)
         {
-            if(!first_arg.compare("chprompt"))
-            {
-                arrayFree(args, args_num);
-                return new ChpromptCommand(cmd_line);
-            }
-            else if(!first_arg.compare("quit"))
-            {
-                arrayFree(args, args_num);
-                return new QuitCommand(cmd_line, SmallShell::getInstance().getJobsList());
-            }
-            else if(!first_arg.compare("showpid"))
-            {
-                arrayFree(args, args_num);
-                return new ShowPidCommand(cmd_line);
-            }
-            else if(!first_arg.compare("pwd"))
-            {
-                
-                arrayFree(args, args_num);
-                return new GetCurrDirCommand(cmd_line);
-            }
-            else if(!first_arg.compare("jobs"))
-            {
-                arrayFree(args, args_num);
-                return new JobsCommand(cmd_line, SmallShell::getInstance().getJobsList());
-            }
-            else if(!first_arg.compare("kill"))
-            {
-                if(!args[1] || !args[2] || args[3] \
-                || args[1][1] == '\0' || !isNumber(std::string(args[2]))) // Check correctness of the arguments
-                {
-                    arrayFree(args, args_num);
-                    throw InvalidArgs("kill");
-                }
-                int signum = 0, job_id = 0;
-                bool res = extractIntFlag(args[1], &signum); // Check and extract the flag arg
-                if(!res || !isNumber(static_cast<std::string>(args[2])))
-                {
-                    arrayFree(args, args_num);
-                    throw InvalidArgs("kill");
-                }
-                std::istringstream arg3(args[2]);
-                arg3 >> job_id; // Extract the job id
-                if(SmallShell::getInstance().getJobsList()->getJobById(job_id) == nullptr) // Check if the job currently exists
-                {
-                    arrayFree(args, args_num);
-                    throw JobDoesNotExist("kill", job_id);
-                }
-                arrayFree(args, args_num);
-                return new KillCommand(cmd_line, signum, job_id, SmallShell::getInstance().getJobsList());
-            }
-            else if(!first_arg.compare("cd"))
-            {
-                if (args_num > 2)
-                {
-                    arrayFree(args, args_num);
-                    throw TooManyArgs("cd");
-                }
-                else if (args_num==2)
-                {
-                    if (SmallShell::getInstance().getLastPwd().empty() && (!static_cast<std::string>("-").compare(args[1])))
-                    {
-                        arrayFree(args, args_num);
-                        throw OldPwdNotSet("cd");
-                    }
-                    
-                    arrayFree(args, args_num);
-                    return new ChangeDirCommand(cmd_line);
-                }
-                else
-                {
-                    return nullptr;
-                }
-            }
-            else if(!first_arg.compare("cat"))
-            {
-                if(args_num < 2)
-                {
-                    arrayFree(args, args_num);
-                    throw NotEnoughArgs("cat");
-                }
-                arrayFree(args, args_num);
-                return new CatCommand(cmd_line);
-            }
+            throw InvalidArgs("fg");
+        }
+        arg2 >> job_id;
 
-            else if(!first_arg.compare("fg"))
-            {
-                if (args_num > 1)
-                {
-                    int job_id;
-                    std::istringstream arg2(args[1]);
-                    
-                    if(!isNumber(args[1], false) || args_num > 2)
-                    {
-                        arrayFree(args, args_num);
-                        throw InvalidArgs("fg");
-                    }
-                    arg2 >> job_id;
+        if(!SmallShell::getInstance().getJobsList()->getJobById(job_id))
+        {
+            throw JobDoesNotExist("fg", job_id);
+        }
+    }
 
-                    if(!SmallShell::getInstance().getJobsList()->getJobById(job_id))
-                    {
-                        arrayFree(args, args_num);
-                        throw JobDoesNotExist("fg", job_id);
-                    }
-                }
+    if (args_num==1 && SmallShell::getInstance().getJobsList()->isEmpty())
+    {
+        throw JobsListIsEmpty("fg");
+    }
+    return new ForegroundCommand(cmd_line);
+}
 
-                if (args_num==1 && SmallShell::getInstance().getJobsList()->isEmpty())
-                {
-                    arrayFree(args, args_num);
-                    throw JobsListIsEmpty("fg");
-                }
-                arrayFree(args, args_num);
-                return new ForegroundCommand(cmd_line);
-            }
-            else if(!first_arg.compare("bg"))
-            {
-                if (args_num > 1)
-                {
-                    int job_id;
-                    std::istringstream arg2(args[1]);
-                    
-                    if (!isNumber(args[1], false) || args_num > 2)
-                    {
-                        arrayFree(args, args_num);
-                        throw InvalidArgs("bg");
-                    }
-                    arg2 >> job_id;
+static Command* _createBg(const CommandLine& cmd_line)
+{
+    std::size_t args_num = cmd_line.argsCount();
+    if (args_num > 1)
+    {
+        int job_id;
+        std::istringstream arg2(cmd_line.argString(1));
+        
+        if (!isNumber(cmd_line.argString(1), false) || args_num > 2)
+        {
+            throw InvalidArgs("bg");
+        }
+        arg2 >> job_id;
 
-                    if (!SmallShell::getInstance().getJobsList()->getJobById(job_id))
-                    {
-                        arrayFree(args, args_num);
-                        throw JobDoesNotExist("bg", job_id);
-                    }
+        if (!SmallShell::getInstance().getJobsList()->getJobById(job_id))
+        {
+            throw JobDoesNotExist("bg", job_id);
+        }
 
-                    // If job is not stopped then it's in background (you cannot type this command if its in the foreground)
-                    if (SmallShell::getInstance().getJobsList()->getJobById(job_id)->state != STOPPED)
-                    {
-                        arrayFree(args, args_num);
-                        throw JobIsAlreadyBackground("bg", job_id);
-                    }
-                }
+        // If job is not stopped then it's in background (you cannot type this command if its in the foreground)
+        if (SmallShell::getInstance().getJobsList()->getJobById(job_id)->state != STOPPED)
+        {
+            throw JobIsAlreadyBackground("bg", job_id);
+        }
+    }
 
-                if(args_num == 1 && (!SmallShell::getInstance().getJobsList()->getLastStoppedJob()))
-                {
-                    arrayFree(args, args_num);
-                    throw NoStoppedJob("bg");
-                }
-                arrayFree(args, args_num);
-                return new BackgroundCommand(cmd_line);
-            }
+    if(args_num == 1 && (!SmallShell::getInstance().getJobsList()->getLastStoppedJob()))
+    {
+        throw NoStoppedJob("bg");
+    }
+    return new BackgroundCommand(cmd_line);
+}
 
-            else if(!first_arg.compare("timeout"))
-            {
-                if(args_num < 3)
-                {
-                    arrayFree(args, args_num);
-                    throw NotEnoughArgs("timeout");
-                }
-                if(!isNumber(std::string(args[1]), true))
-                {
-                    arrayFree(args, args_num);
-                    throw InvalidArgs("timeout");
-                }
-                std::istringstream time_text(args[1]);
-                int duration = 0;
-                time_text >> duration;
+/**
+* Creates and returns a pointer to Command class which matches the given (already parsed) command line
+*/
+Command* SmallShell::CreateCommand(const CommandLine& cmd_line, bool valid_job, bool to_wait)
+{
+    STATS_SCOPE(StatPhase::Create);
+    if(!cmd_line.isValid())
+    {
+        return nullptr;
+    }
+    CMD_Type type = cmd_line.getType();
+    std::size_t args_num = cmd_line.argsCount();
+    std::string first_arg = cmd_line.argString(0);
 
-                if(duration == 0)
-                {
-                    arrayFree(args, args_num);
-                    throw InvalidArgs("timeout");
-                }
+    if(!first_arg.compare("time")) // A prefix to any command line (pipelines and redirections included).
+    {
+        if(args_num < 2)
+        {
+            throw NotEnoughArgs("time");
+        }
+        if(type == CMD_Type::Background) // Nothing to wait for, so nothing to time.
+        {
+            return CreateCommand(cmd_line.shiftArgs(1), valid_job, to_wait);
+        }
+        return new TimeCommand(cmd_line);
+    }
 
-                arrayFree(args, args_num);
-                return new TimeoutCommand(cmd_line, false, duration, valid_job);
-            }
-            else if(args_num) // This is an external command
+    switch(type)
+    {
+        case CMD_Type::Normal:
+        {
+            auto builtin = builtins.find(first_arg);
+            if(builtin != builtins.end())
             {
-                arrayFree(args, args_num);
-                return new ExternalCommand(cmd_line, false, valid_job, to_wait);
+                return builtin->second(cmd_line);
             }
-            break;
+            // Not a builtin: timeout and external commands are handled the same for both types.
+            __attribute__((fallthrough));
         }
         case CMD_Type::Background:
         {
+            bool is_background = (type == CMD_Type::Background);
             if(!first_arg.compare("timeout"))
             {
                 if(args_num < 3)
                 {
-                    arrayFree(args, args_num);
                     throw NotEnoughArgs("timeout");
                 }
-                if(!isNumber(std::string(args[1]), true))
-                {
-                    arrayFree(args, args_num);
-                    throw InvalidArgs("timeout");
-                }
-                std::istringstream time_text(args[1]);
-                int duration = 0;
-                time_text >> duration;
-
-                if(duration == 0)
+                long long duration_ns = 0;
+                if(!extractDuration(cmd_line.argString(1), &duration_ns))
                 {
-                    arrayFree(args, args_num);
                     throw InvalidArgs("timeout");
                 }
-
-                arrayFree(args, args_num);
-                return new TimeoutCommand(cmd_line, true, duration, valid_job);
+                return new TimeoutCommand(cmd_line, is_background, duration_ns, valid_job, to_wait);
             }
-            else if(args_num)
+            else if(args_num) // This is an external command
             {
-                arrayFree(args, args_num);
-                return new ExternalCommand(cmd_line, true, valid_job, to_wait);
+                return new ExternalCommand(cmd_line, is_background, valid_job, to_wait);
             }
             break;
         }
         case CMD_Type::OutRed: case CMD_Type::OutAppend:
         {
-            if(args_num > 2)
-            {
-                int op_index = 0;
-                bool flag = false;
-                for( ; (op_index < args_num) && !flag; op_index++)
-                {
-                    if(!strcmp(args[op_index], type == CMD_Type::OutRed? ">" : ">>"))
-                    {
-                        flag = true;
-                    }
-                }
-                op_index--;
-
-                if(op_index != args_num - 2) // The operator must be one before the last word in the args list.
-                {
-                    arrayFree(args, args_num);
-                    return nullptr;
-                }
-                arrayFree(args, args_num);
-                return new RedirectionCommand(cmd_line, type);
-            }
-            break;
+            return new RedirectionCommand(cmd_line, type);
         }
         case CMD_Type::Pipe: case CMD_Type::ErrPipe:
         {
-            if(args_num > 2)
-            {
-                int op_index = 0;
-                bool flag = false;
-                for( ; (op_index < args_num) && !flag; op_index++)
-                {
-                    if(!strcmp(args[op_index], type == CMD_Type::Pipe? "|" : "|&"))
-                    {
-                        flag = true;
-                    }
-                }
-                op_index--;
-
-                if(op_index == 0 || op_index == args_num - 1)
-                {
-                    arrayFree(args, args_num);
-                    return nullptr;
-                }
-
-                arrayFree(args, args_num);
-                return new PipeCommand(cmd_line, type);
-            }
-            break;
+            return new PipeCommand(cmd_line, type);
         }
         default: // Should not get here.
             break;
     }
-    arrayFree(args, args_num);
     return nullptr;
 } 
 
-void SmallShell::executeCommand(const char *cmd_line)
+static CommandLine _parseLine(const char *cmd_text)
 {
-    SmallShell::getInstance().getJobsList()->updateAllJobs(); // Update all the jobs upon execution
-    CMD_Type type = _processCommandLine(cmd_line);
+    STATS_SCOPE(StatPhase::Parse);
+    return CommandLine(cmd_text);
+}
+
+void SmallShell::executeCommand(const char *cmd_text)
+{
+    STATS_SCOPE(StatPhase::Execute);
+    SmallShell::getInstance().getJobsList()->updateAllJobs(); // Update all the jobs upon execution
+    CommandLine cmd_line = _parseLine(cmd_text); // Parsed once, then passed as is to the command.
+    CMD_Type type = cmd_line.getType();
     switch(type)
     {
         case CMD_Type::Normal: 
@@ -545,7 +462,7 @@ void SmallShell::executeCommand(const char *cmd_line)
         }
         case CMD_Type::Background:
         {
-            if(!isBuiltIn(cmd_line))
+            if(!isBuiltIn(cmd_line.argString(0)))
             {
                 Command* cmd = nullptr;
                 try
@@ -581,14 +498,6 @@ void SmallShell::executeCommand(const char *cmd_line)
 }
 
 //*********************AUXILIARY********************//
-void arrayFree(char **arr, int len)
-{
-    for(int i = 0; i < len; i++)
-    {
-        free(arr[i]);
-    }
-}
-
 bool isNumber(const std::string& str, bool is_unsigned)
 {
     int i = 0;
@@ -634,12 +543,200 @@ bool extractIntFlag(const std::string& str, int* flag_num)
     return true;
 }
 
+/**
+ * Extracts a positive timeout duration given in seconds, with an optional fraction ("5", "0.25").
+ * Returns true and puts the duration in nanoseconds in duration_ns if the format is valid, otherwise returns false.
+ */
+bool extractDuration(const std::string& str, long long* duration_ns)
+{
+    std::size_t dot = str.find('.');
+    std::string whole = str.substr(0, dot);
+    std::string fraction = (dot == std::string::npos)? "" : str.substr(dot + 1);
+    if((whole.empty() && fraction.empty()) || !isNumber(whole, true) || !isNumber(fraction, true) ||
+        whole.size() > 9 || fraction.size() > 9)
+    {
+        return false;
+    }
+
+    long long ns = 0;
+    for(char c : whole)
+    {
+        ns = ns * 10 + (c - '0');
+    }
+    ns *= 1000000000LL;
+    long long digit_weight = 100000000LL;
+    for(char c : fraction)
+    {
+        ns += (c - '0') * digit_weight;
+        digit_weight /= 10;
+    }
+    if(ns == 0)
+    {
+        return false;
+    }
+    if(duration_ns)
+    {
+        *duration_ns = ns;
+    }
+    return true;
+}
+
+/**
+ * Prints user/sys CPU time, max RSS and voluntary/involuntary context switches, e.g.
+ * "user 0.120s sys 0.010s maxrss 2048KB ctxsw 12/3".
+ */
+void printUsage(std::ostream& out, const struct rusage& usage)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3)
+        << "user " << usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 << "s"
+        << " sys " << usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 << "s"
+        << " maxrss " << usage.ru_maxrss << "KB"
+        << " ctxsw " << usage.ru_nvcsw << "/" << usage.ru_nivcsw;
+    out.flags(flags);
+    out.precision(precision);
+}
+
+/**
+ * Describes a wait status: "exit <code>", "killed by signal <sig>" or "stopped by signal <sig>".
+ */
+std::string describeStatus(int status)
+{
+    if(WIFEXITED(status))
+    {
+        return "exit " + std::to_string(WEXITSTATUS(status));
+    }
+    if(WIFSIGNALED(status))
+    {
+        return "killed by signal " + std::to_string(WTERMSIG(status));
+    }
+    if(WIFSTOPPED(status))
+    {
+        return "stopped by signal " + std::to_string(WSTOPSIG(status));
+    }
+    return "running";
+}
+
 //******************COMMAND CLASSES*****************//
 const std::string& Command::getCmdLine() const
+{
+    return *cmd_text;
+}
+
+const CmdText& Command::getCmdText() const
 {
     return cmd_text;
 }
 
+void Command::setOutput(int fd)
+{
+    sink.reset(); // Flushes whatever was written to the previous target.
+    out_fd = fd;
+}
+
+std::ostream& Command::out()
+{
+    if(out_fd == -1)
+    {
+        return std::cout;
+    }
+    if(!sink)
+    {
+        sink.reset(new OutputSink(out_fd));
+    }
+    return *sink;
+}
+
+//*****************COMMAND ARENA*****************//
+// A bump allocator: every Command of a line is carved from one static block, and the block is reused from its start
+// once they are all deleted. The most recent allocation is also given back right away when deleted (e.g. the per-command
+// objects parallel creates and deletes one by one). Whatever does not fit falls back to the heap.
+#define COMMAND_ARENA_ALIGN (alignof(std::max_align_t))
+
+alignas(std::max_align_t) static unsigned char command_arena[COMMAND_ARENA_SIZE];
+static std::size_t arena_top = 0;  // Offset of the first free byte
+static std::size_t arena_live = 0; // Commands currently allocated from the arena
+
+static std::size_t arenaRound(std::size_t size)
+{
+    return (size + COMMAND_ARENA_ALIGN - 1) & ~(COMMAND_ARENA_ALIGN - 1);
+}
+
+void* Command::operator new(std::size_t size)
+{
+    std::size_t rounded = arenaRound(size);
+    if(arena_top + rounded > COMMAND_ARENA_SIZE)
+    {
+        return ::operator new(size);
+    }
+    void* ptr = command_arena + arena_top;
+    arena_top += rounded;
+    arena_live++;
+    return ptr;
+}
+
+void Command::operator delete(void* ptr, std::size_t size)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr), base = reinterpret_cast<uintptr_t>(command_arena);
+    if(addr < base || addr >= base + COMMAND_ARENA_SIZE)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+    if(--arena_live == 0)
+    {
+        arena_top = 0;
+    }
+    else if(addr + arenaRound(size) == base + arena_top)
+    {
+        arena_top = addr - base;
+    }
+}
+
+//***************COMMAND TEXT POOL***************//
+struct TextPtrHash
+{
+    std::size_t operator()(const std::string* str) const
+    {
+        return std::hash<std::string>()(*str);
+    }
+};
+
+struct TextPtrEqual
+{
+    bool operator()(const std::string* a, const std::string* b) const
+    {
+        return *a == *b;
+    }
+};
+
+// Keyed by the pooled string itself, so the pool holds no copy of its own. An entry is erased by its text's deleter.
+typedef std::unordered_map<const std::string*, std::weak_ptr<const std::string>, TextPtrHash, TextPtrEqual> TextPool;
+
+static TextPool& textPool()
+{
+    static TextPool* pool = new TextPool(); // Never destroyed: jobs may still release texts during static destruction.
+    return *pool;
+}
+
+CmdText internCmdText(const std::string& text)
+{
+    TextPool& pool = textPool();
+    auto found = pool.find(&text);
+    if(found != pool.end())
+    {
+        return found->second.lock();
+    }
+    CmdText shared(new std::string(text), [](const std::string* str)
+    {
+        textPool().erase(str);
+        delete str;
+    });
+    pool.emplace(shared.get(), shared);
+    return shared;
+}
+
 int Command::getPid() const
 {
     return pid;
@@ -650,829 +747,1974 @@ bool Command::isBackground() const
     return is_background;
 }
 
-ChpromptCommand::ChpromptCommand(const char *cmd_line) : BuiltInCommand(cmd_line)
+ChpromptCommand::ChpromptCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line)
 {
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    if(args[1] != NULL)
+    if(cmd_line.argsCount() > 1)
     {
-        new_prompt = args[1];
+        new_prompt = cmd_line.argString(1);
     }
     else
     {
-        new_prompt = "smash";
+        new_prompt = "smash";
+    }
+}
+
+void ChpromptCommand::execute() // chprompt exec
+{
+    SmallShell::getInstance().setPrompt(new_prompt);
+}
+
+QuitCommand::QuitCommand(const CommandLine& cmd_line, std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs)
+{
+    if (cmd_line.argsCount() > 1) //there is another argument after quit
+    {
+        if(cmd_line.argEquals(1, "kill"))
+        {
+            is_kill = true;
+        }
+        else if(cmd_line.argEquals(1, "term"))
+        {
+            is_term = true;
+            if(cmd_line.argsCount() > 2) // Already checked by the factory
+            {
+                extractDuration(cmd_line.argString(2), &grace_ns);
+            }
+        }
+    }
+}
+
+
+void QuitCommand::execute()
+{
+    if(is_kill)
+    {
+        jobs->killAllJobs(out());
+    }
+    else if(is_term)
+    {
+        jobs->killAllJobs(out(), SIGTERM, grace_ns);
+    }
+    const char* stats_file = getenv("SMASH_STATS_FILE");
+    if(stats_file)
+    {
+        std::ofstream out(stats_file, std::ios::app);
+        if(out)
+        {
+            statsPrint(out, true);
+        }
+        else
+        {
+            std::cerr << "smash error: quit: cannot write stats to " << stats_file << std::endl;
+        }
+    }
+    SmallShell::getInstance().quit_flag = true;
+}
+
+StatsCommand::StatsCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line)
+{
+    histograms = cmd_line.argEquals(1, "-v");
+    reset = cmd_line.argEquals(1, "reset");
+}
+
+void StatsCommand::execute()
+{
+    if(reset)
+    {
+        statsReset();
+        return;
+    }
+    statsPrint(out(), histograms);
+}
+
+/**
+ * The arguments are already checked by the factory. A template without "{}" gets each argument appended.
+ */
+ParallelCommand::ParallelCommand(const CommandLine& cmd_line, unsigned int max_running) : BuiltInCommand(cmd_line), max_running(max_running)
+{
+    std::size_t first = cmd_line.argEquals(1, "-j")? 3 : 1;
+    if(cmd_line.argEquals(first, "-f"))
+    {
+        cmds_file = cmd_line.argString(first + 1);
+        return;
+    }
+    std::size_t args_start = cmd_line.argsCount();
+    std::string cmd_template;
+    for(std::size_t i = first; i < cmd_line.argsCount(); i++)
+    {
+        if(cmd_line.argEquals(i, ":::"))
+        {
+            args_start = i + 1;
+            break;
+        }
+        cmd_template += (cmd_template.empty()? "" : " ") + cmd_line.argString(i);
+    }
+    if(args_start == cmd_line.argsCount()) // No arguments: the template is the only command.
+    {
+        cmd_texts.push_back(cmd_template);
+        return;
+    }
+    bool has_slot = (cmd_template.find("{}") != std::string::npos);
+    for(std::size_t i = args_start; i < cmd_line.argsCount(); i++)
+    {
+        std::string arg = cmd_line.argString(i);
+        if(!has_slot)
+        {
+            cmd_texts.push_back(cmd_template + " " + arg);
+            continue;
+        }
+        std::string cmd_text = cmd_template;
+        for(std::size_t pos = cmd_text.find("{}"); pos != std::string::npos; pos = cmd_text.find("{}", pos + arg.size()))
+        {
+            cmd_text.replace(pos, 2, arg);
+        }
+        cmd_texts.push_back(cmd_text);
+    }
+}
+
+void ParallelCommand::reportExit(std::size_t index, int status, long long elapsed_ns)
+{
+    std::ostream& report = out();
+    report << "[" << index + 1 << "] " << cmd_texts[index] << " : " << describeStatus(status);
+    report << " " << std::fixed << std::setprecision(3) << elapsed_ns / 1e9 << " secs" << std::endl;
+    report.unsetf(std::ios::floatfield);
+    report << std::setprecision(6);
+}
+
+/**
+ * Keeps at most max_running of the commands running as jobs, starting the next one whenever one exits.
+ * Lines that do not start a child (builtins, pipelines, redirections) run inline and are not reported.
+ * ctrl-C kills the running children and ctrl-Z stops them (they stay as stopped jobs); both end the scheduling.
+ */
+void ParallelCommand::execute()
+{
+    if(!cmds_file.empty())
+    {
+        int fd = open(cmds_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+        {
+            throw SyscallError("open");
+        }
+        LineReader reader(fd);
+        std::string line;
+        try
+        {
+            while(reader.nextLine(line))
+            {
+                if(line.find_first_not_of(WHITESPACE) != std::string::npos)
+                {
+                    cmd_texts.push_back(line);
+                }
+            }
+        }
+        catch(const std::exception& e)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    SmallShell& smash = SmallShell::getInstance();
+    std::shared_ptr<JobsList> jobs = smash.getJobsList();
+    std::vector<pid_t> running_pids;
+    std::vector<int> running_pidfds;
+    std::vector<std::size_t> running_index;
+    std::vector<long long> running_start;
+    // The running children are the foreground for ctrl-C / ctrl-Z, which stop the scheduler by resetting the batch.
+    const std::vector<pid_t>* outer_batch = smash.getCurrentFgBatch();
+    smash.setCurrentFgBatch(&running_pids);
+    std::size_t next = 0;
+    try
+    {
+        while((next < cmd_texts.size() && smash.getCurrentFgBatch() == &running_pids) || !running_pids.empty())
+        {
+            while(running_pids.size() < max_running && next < cmd_texts.size() && smash.getCurrentFgBatch() == &running_pids)
+            {
+                std::size_t index = next++;
+                Command* cmd = nullptr;
+                try
+                {
+                    cmd = smash.CreateCommand(CommandLine(cmd_texts[index]), true, false);
+                    if(!cmd)
+                    {
+                        continue;
+                    }
+                    cmd->setOutput(out_fd);
+                    long long start = monotonicNs();
+                    cmd->execute();
+                    pid_t c_pid = cmd->getPid();
+                    delete cmd;
+                    cmd = nullptr;
+                    if(c_pid == 0) // Ran inline.
+                    {
+                        continue;
+                    }
+                    smash.setCurrentFg(0, 0); // The commands are never the foreground job, parallel is.
+                    JobEntry* jcb = jobs->getJobByPid(c_pid);
+                    jobs->watchChild(c_pid); // An inline line reaping it (updateAllJobs) must not lose its status.
+                    running_pids.push_back(c_pid);
+                    // Our own copy: the job's pidfd is closed as soon as anyone removes the job (ctrl-C, an inline
+                    // updateAllJobs). Without one, the wait falls back to SIGCHLD.
+                    running_pidfds.push_back((jcb && jcb->pidfd != -1)? fcntl(jcb->pidfd, F_DUPFD_CLOEXEC, 0) : -1);
+                    running_index.push_back(index);
+                    running_start.push_back(start);
+                }
+                catch(const std::exception& e)
+                {
+                    delete cmd;
+                    std::cerr << e.what() << std::endl;
+                }
+            }
+            if(running_pids.empty())
+            {
+                continue;
+            }
+
+            int status = 0;
+            struct rusage usage = {};
+            int done = waitAnyChild(running_pids, running_pidfds, &status, &usage, WUNTRACED);
+            if(done == -1)
+            {
+                throw SyscallError("wait4");
+            }
+            long long elapsed_ns = monotonicNs() - running_start[done];
+            jobs->applyChildStatus(running_pids[done], status, &usage); // Removes the job (and its pidfd, and its timeout).
+            jobs->unwatchChild(running_pids[done]);
+            if(!WIFSTOPPED(status)) // A stopped child stays in the jobs list, like any stopped job.
+            {
+                reportExit(running_index[done], status, elapsed_ns);
+            }
+
+            // Swap-remove the finished child.
+            if(running_pidfds[done] != -1)
+            {
+                close(running_pidfds[done]);
+            }
+            running_pids[done] = running_pids.back();
+            running_pids.pop_back();
+            running_pidfds[done] = running_pidfds.back();
+            running_pidfds.pop_back();
+            running_index[done] = running_index.back();
+            running_index.pop_back();
+            running_start[done] = running_start.back();
+            running_start.pop_back();
+        }
+    }
+    catch(const std::exception& e)
+    {
+        for(std::size_t i = 0; i < running_pids.size(); i++) // Left as ordinary jobs.
+        {
+            jobs->unwatchChild(running_pids[i]);
+            if(running_pidfds[i] != -1)
+            {
+                close(running_pidfds[i]);
+            }
+        }
+        smash.setCurrentFgBatch((smash.getCurrentFgBatch() == &running_pids)? outer_batch : nullptr);
+        throw;
+    }
+    smash.setCurrentFgBatch((smash.getCurrentFgBatch() == &running_pids)? outer_batch : nullptr);
+}
+
+ShowPidCommand::ShowPidCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line) { }
+
+void ShowPidCommand::execute()
+{
+    out() << "smash pid is " << SmallShell::getInstance().getPid() << " " << '\n';
+}
+
+GetCurrDirCommand::GetCurrDirCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line) { }
+
+/**
+ * getcwd() into a buffer that grows until the path fits, so deep directories are never truncated.
+ */
+static std::string _currentDir()
+{
+    std::vector<char> buff(256);
+    while(getcwd(buff.data(), buff.size()) == NULL)
+    {
+        if(errno != ERANGE)
+        {
+            throw SyscallError("getcwd");
+        }
+        buff.resize(buff.size() * 2);
+    }
+    return buff.data();
+}
+
+void GetCurrDirCommand::execute()
+{
+    try
+    {
+        out() << _currentDir() << '\n';
+    }
+    catch(const SyscallError& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+ChangeDirCommand::ChangeDirCommand(const CommandLine& cmd_line): BuiltInCommand(cmd_line)
+{
+    pathname = cmd_line.argString(1);
+}
+
+void ChangeDirCommand::execute()
+{
+    if (!static_cast<std::string>("-").compare(pathname))
+    {
+        std::string current = _currentDir();
+        if (chdir((SmallShell::getInstance().getLastPwd()).c_str()) == -1) // Attempt to change the dir to the previous one
+        {
+            throw SyscallError("chdir");
+        }
+        // On success, replace the previous dir with the current one (on the smash memory)
+        
+        SmallShell::getInstance().setLastPwd(current);
+    }
+    else
+    {
+        std::string current = _currentDir();
+        if ((chdir(pathname.c_str()))==-1)
+        {
+            throw SyscallError("chdir");
+        }
+        SmallShell::getInstance().setLastPwd(current);
+    }
+}
+
+JobsCommand::JobsCommand(const CommandLine& cmd_line, std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs)
+{
+    long_format = cmd_line.argEquals(1, "-l");
+}
+
+void JobsCommand::execute()
+{
+    jobs->printJobsList(out());
+    if(long_format)
+    {
+        jobs->printFinishedJobs(out());
+    }
+}
+
+KillCommand::KillCommand(const CommandLine& cmd_line, int signum, bool by_group, const std::vector<JobRange>& targets,
+    std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), signum(signum), by_group(by_group), targets(targets), jobs(jobs) { }
+
+/**
+ * Signals every selected job in one pass over the jobs list, in job id order, and reports them all at once.
+ * With -g, each job's process group gets the signal instead (every job leads its own group), once per group.
+ */
+void KillCommand::execute()
+{
+    dispatchSignals(true); // A single update pass: the states the filters see include every pending SIGCHLD.
+    std::vector<JobEntry*> selected = jobs->selectJobs(targets);
+    std::unordered_set<pid_t> signalled_groups;
+    std::ostream& report = out();
+    for(JobEntry* jcb : selected)
+    {
+        pid_t to_signal = jcb->pid;
+        if(by_group && !signalled_groups.insert(to_signal).second)
+        {
+            continue;
+        }
+        if((by_group? killpg(to_signal, signum) : signalChild(to_signal, jcb->pidfd, signum)) == -1)
+        {
+            perror(by_group? "smash error: killpg failed" : "smash error: kill failed");
+            continue;
+        }
+        report << "signal number " << signum << " was sent to " << (by_group? "process group " : "pid ") << to_signal << '\n';
+        if(signum == SIGCONT && jcb->state == STOPPED) // Like bg: a later "@running" must already see it running.
+        {
+            jobs->setJobState(jcb, RUNNING);
+        }
+    }
+}
+
+ExternalCommand::ExternalCommand(const CommandLine& cmd_line, bool is_background, bool valid_job, bool to_wait) : 
+Command(cmd_line, is_background, 0, valid_job, to_wait), is_background(is_background), exec_line(cmd_line) { }
+
+static void _setBashRequest(SpawnRequest& req, const std::string& exec_line)
+{
+    req.path = "/bin/bash";
+    req.script = exec_line;
+    req.argv = {"bash", "-c", req.script.c_str()};
+}
+
+/**
+ * Fills req with the exec arguments of an external command line.
+ * Simple commands are resolved through the PATH cache and exec'ed directly, anything else goes through bash.
+ * The direct argv points straight into the parsed line (its tokens are NUL-terminated), so it is only bounded by ARG_MAX.
+ * Returns true if the direct exec path was chosen.
+ */
+bool _buildExecRequest(const CommandLine& cmd_line, SpawnRequest& req)
+{
+    std::string exec_line = cmd_line.stageText();
+    req.argv.clear();
+    if(!_isComplexCommand(exec_line))
+    {
+        req.argv.reserve(cmd_line.argsCount());
+        for(std::size_t i = 0; i < cmd_line.argsCount(); i++)
+        {
+            req.argv.push_back(cmd_line.arg(i));
+        }
+        if(!req.argv.empty() && SmallShell::getInstance().getPathCache().resolve(req.argv[0], req.path))
+        {
+            return true;
+        }
+    }
+    _setBashRequest(req, exec_line);
+    return false;
+}
+
+/**
+ * Spawns the external command line described by req, falling back to bash if the direct exec fails.
+ */
+pid_t _spawnExternal(const CommandLine& cmd_line, SpawnRequest& req)
+{
+    if(_buildExecRequest(cmd_line, req))
+    {
+        try
+        {
+            return spawnProcess(req);
+        }
+        catch(const SyscallError& e) // The direct exec failed (e.g. stale cache entry), let bash handle it.
+        {
+            if(!argvFits(req.argv)) // bash could not take the line either.
+            {
+                throw;
+            }
+            SmallShell::getInstance().getPathCache().invalidate();
+            _setBashRequest(req, cmd_line.stageText());
+        }
+    }
+    return spawnProcess(req);
+}
+
+void ExternalCommand::execute()
+{
+    SpawnRequest req;
+    if(out_fd != -1)
+    {
+        req.dup_fds.push_back({out_fd, STDOUT_FILENO});
+    }
+    this->pid = _spawnExternal(exec_line, req);
+
+    JobEntry* jcb_ptr = nullptr;
+    if(this->valid_job) jcb_ptr = SmallShell::getInstance().getJobsList()->addJob(this);
+
+    if(!is_background && to_wait)
+    {
+        SmallShell::getInstance().setCurrentFg(jcb_ptr == nullptr? 0 : jcb_ptr->job_id, this->pid); // Set the current fg
+        SmallShell::getInstance().getJobsList()->waitForeground(pid);
+        SmallShell::getInstance().setCurrentFg(0, 0); // Reset the current fg
+    }
+}
+
+TimeoutCommand::TimeoutCommand(const CommandLine& cmd_line, bool is_background, long long duration_ns, bool valid_job, bool to_wait) :
+ExternalCommand(cmd_line, is_background, valid_job, to_wait), duration_ns(duration_ns), command(NULL)
+{ 
+    command = SmallShell::getInstance().CreateCommand(cmd_line.shiftArgs(2), false, false); // Skip "timeout <duration>"
+}
+
+TimeoutCommand::~TimeoutCommand()
+{
+    if(command)
+    {
+        delete command;
+    }
+}
+
+void TimeoutCommand::setOutput(int fd)
+{
+    Command::setOutput(fd);
+    if(command)
+    {
+        command->setOutput(fd);
+    }
+}
+
+void TimeoutCommand::execute()
+{
+    if(!command)
+    {
+        return;
+    }
+    command->execute();
+    this->pid = command->getPid();
+    if(this->pid == 0) // A builtin already ran to completion, there is nothing to time out.
+    {
+        return;
+    }
+    JobEntry* jcb_ptr = nullptr;
+    if(this->valid_job) jcb_ptr = SmallShell::getInstance().getJobsList()->addJob(this);
+
+    SmallShell& smash = SmallShell::getInstance();
+    smash.getAlarmList()->addAlarm(this->pid, this->cmd_text, duration_ns);
+    
+    if(!is_background && to_wait)
+    {
+        smash.setCurrentFg(jcb_ptr == nullptr? 0 : jcb_ptr->job_id, this->pid); // Set the current fg
+        smash.getJobsList()->waitForeground(pid);
+        smash.setCurrentFg(0, 0); // Reset the current fg.
+    }
+}
+
+TimeCommand::TimeCommand(const CommandLine& cmd_line) : Command(cmd_line, false, 0, false), command(NULL)
+{
+    command = SmallShell::getInstance().CreateCommand(cmd_line.shiftArgs(1)); // Skip "time"
+}
+
+TimeCommand::~TimeCommand()
+{
+    if(command)
+    {
+        delete command;
+    }
+}
+
+void TimeCommand::setOutput(int fd)
+{
+    Command::setOutput(fd);
+    if(command)
+    {
+        command->setOutput(fd);
+    }
+}
+
+/**
+ * Runs the command in the foreground and prints (to stderr, like bash) its wall time and resource usage:
+ * that of the children it waited for, plus smash's own for builtins.
+ */
+void TimeCommand::execute()
+{
+    if(!command)
+    {
+        return;
+    }
+    std::shared_ptr<JobsList> jobs = SmallShell::getInstance().getJobsList();
+    jobs->resetLastUsage();
+    struct rusage self_before, self_after;
+    getrusage(RUSAGE_SELF, &self_before);
+    long long start = monotonicNs();
+    try
+    {
+        command->execute();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    long long real_ns = monotonicNs() - start;
+    getrusage(RUSAGE_SELF, &self_after);
+
+    struct rusage usage = jobs->getLastUsage();
+    struct timeval delta;
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &delta);
+    timeradd(&usage.ru_utime, &delta, &usage.ru_utime);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &delta);
+    timeradd(&usage.ru_stime, &delta, &usage.ru_stime);
+    usage.ru_nvcsw += self_after.ru_nvcsw - self_before.ru_nvcsw;
+    usage.ru_nivcsw += self_after.ru_nivcsw - self_before.ru_nivcsw;
+
+    std::cout.flush(); // Keep the command's own output before the report.
+    std::ios::fmtflags flags = std::cerr.flags();
+    std::cerr << "real " << std::fixed << std::setprecision(3) << real_ns / 1e9 << "s ";
+    std::cerr.flags(flags);
+    std::cerr << std::setprecision(6);
+    printUsage(std::cerr, usage);
+    std::cerr << std::endl;
+}
+
+CatCommand::CatCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line)
+{
+    for(std::size_t i = 1; i < cmd_line.argsCount(); i++)
+    {
+        f_queue.emplace(cmd_line.arg(i), cmd_line.argLength(i));
+    }
+}
+
+/**
+ * Picks the cheapest way to move file data into out_fd, according to its type:
+ * regular file - copy_file_range, pipe - splice, anything else - sendfile.
+ */
+CopyMethod CatCommand::pickCopyMethod(int out_fd)
+{
+    struct stat out_stat;
+    if(fstat(out_fd, &out_stat) == -1)
+    {
+        return CopyMethod::ReadWrite;
+    }
+    if(S_ISREG(out_stat.st_mode))
+    {
+        return CopyMethod::CopyFileRange;
+    }
+    if(S_ISFIFO(out_stat.st_mode))
+    {
+        return CopyMethod::Splice;
+    }
+    return CopyMethod::SendFile;
+}
+
+/**
+ * Copies in_fd to out_fd inside the kernel with the given method, without passing through user space.
+ * Returns true once the whole input was copied, or false if the method is not supported for these fds,
+ * in which case the remainder of the input should be copied another way (the input offset is kept consistent).
+ */
+bool CatCommand::copyZeroCopy(int in_fd, int out_fd, CopyMethod method, unsigned long long& copied)
+{
+    ssize_t res;
+    while(true)
+    {
+        switch(method)
+        {
+            case CopyMethod::CopyFileRange:
+                res = copy_file_range(in_fd, NULL, out_fd, NULL, ZERO_COPY_CHUNK, 0);
+                break;
+            case CopyMethod::Splice:
+                res = splice(in_fd, NULL, out_fd, NULL, ZERO_COPY_CHUNK, SPLICE_F_MORE);
+                break;
+            case CopyMethod::SendFile:
+                res = sendfile(out_fd, in_fd, NULL, ZERO_COPY_CHUNK);
+                break;
+            default:
+                return false;
+        }
+
+        if(res == 0) // EOF
+        {
+            return true;
+        }
+        if(res > 0)
+        {
+            copied += res;
+        }
+        if(res == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EINVAL || errno == EXDEV || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                return false;
+            }
+            if(errno == EPIPE) // The reader is gone (SIGPIPE is ignored inline): stop quietly, like a killed cat.
+            {
+                return true;
+            }
+            throw SyscallError(method == CopyMethod::CopyFileRange? "copy_file_range" : 
+                               method == CopyMethod::Splice? "splice" : "sendfile");
+        }
+    }
+}
+
+void CatCommand::copyReadWrite(int in_fd, int out_fd, unsigned long long& copied)
+{
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    ssize_t read_res;
+    while((read_res = read(in_fd, buffer.data(), READ_BUFFER_SIZE)))
+    {
+        if(read_res == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            throw SyscallError("read");
+        }
+        for(ssize_t written = 0, write_res; written < read_res; written += write_res)
+        {
+            if((write_res = write(out_fd, buffer.data() + written, read_res - written)) == -1)
+            {
+                if(errno == EINTR)
+                {
+                    write_res = 0;
+                    continue;
+                }
+                if(errno == EPIPE)
+                {
+                    return;
+                }
+                throw SyscallError("write");
+            }
+        }
+        copied += read_res;
+    }
+}
+
+CatCommand::~CatCommand()
+{
+    closeAhead();
+}
+
+/**
+ * Opens the next file of the queue and asks the kernel to start reading it in the background, so its data is
+ * (at least partly) cached by the time it is copied. A failed open is kept and only reported when its turn comes.
+ */
+void CatCommand::openAhead()
+{
+    int fd = open(f_queue.front().c_str(), O_RDONLY | O_CLOEXEC);
+    int error = errno;
+    f_queue.pop();
+    if(fd != -1)
+    {
+        posix_fadvise(fd, 0, CAT_READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+    }
+    ahead.push_back({fd, (fd == -1)? error : 0});
+}
+
+void CatCommand::closeAhead()
+{
+    for(auto& file : ahead)
+    {
+        if(file.fd != -1)
+        {
+            close(file.fd);
+        }
+    }
+    ahead.clear();
+}
+
+/**
+ * Copies the files in order. Up to CAT_READAHEAD_FILES files past the current one are already open and being read
+ * ahead, so the disk works on them while the current one is copied.
+ */
+void CatCommand::execute()
+{
+    int fd = 0;
+    int dest_fd = (out_fd == -1)? STDOUT_FILENO : out_fd; // The copy bypasses out(): write to its fd directly.
+    CopyMethod method = pickCopyMethod(dest_fd);
+    unsigned long long copied = 0, files = 0;
+    STATS_START(start);
+
+    while(!ahead.empty() || !f_queue.empty()) // Repeat until every file was copied
+    {
+        while(ahead.size() <= CAT_READAHEAD_FILES && !f_queue.empty())
+        {
+            openAhead();
+        }
+        OpenedFile curr = ahead.front();
+        ahead.pop_front();
+        if((fd = curr.fd) == -1)
+        {
+            errno = curr.error;
+            throw SyscallError("open");
+        }
+        try
+        {
+            // Try the zero-copy methods from the best fitting one down, then fall back to a plain copy.
+            bool done = false;
+            if(method == CopyMethod::CopyFileRange)
+            {
+                done = copyZeroCopy(fd, dest_fd, CopyMethod::CopyFileRange, copied);
+            }
+            if(!done && method == CopyMethod::Splice)
+            {
+                done = copyZeroCopy(fd, dest_fd, CopyMethod::Splice, copied);
+            }
+            if(!done && method != CopyMethod::ReadWrite)
+            {
+                done = copyZeroCopy(fd, dest_fd, CopyMethod::SendFile, copied);
+            }
+            if(!done)
+            {
+                copyReadWrite(fd, dest_fd, copied);
+            }
+        }
+        catch(const std::exception& e)
+        {
+            close(fd);
+            throw;
+        }
+        if(close(fd) == -1)
+        {
+            throw SyscallError("close");
+        }
+        files++;
+    }
+    STATS_COPY(files, copied, start);
+}
+
+
+ForegroundCommand::ForegroundCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line)
+{
+    if(cmd_line.argsCount() > 1)
+    {
+        std::istringstream arg2(cmd_line.argString(1));
+        arg2 >> job_id_to_fg;
+    }
+}
+
+void ForegroundCommand::execute()
+{
+    int job_id = 0;
+    if (job_id_to_fg) //if we got job id in the input command line
+    {
+        job_id = job_id_to_fg;
+    }
+    else
+    {
+        SmallShell::getInstance().getJobsList()->getLastJob(&job_id);
+    }
+    JobEntry* jcb = SmallShell::getInstance().getJobsList()->getJobById(job_id);
+    out() << *jcb->command << " : " << jcb->pid << std::endl; // Flushed before the job takes over the terminal
+    
+    SmallShell::getInstance().setCurrentFg(job_id, jcb->pid);
+    if(jcb->state==STOPPED)
+    {
+        if (signalChild(jcb->pid, jcb->pidfd, SIGCONT) == -1)
+        {
+            throw SyscallError("kill");
+        }
+        SmallShell::getInstance().getJobsList()->setJobState(jcb, RUNNING);
+    }
+    jcb->is_background = false;
+    SmallShell::getInstance().getJobsList()->waitForeground(jcb->pid);
+    SmallShell::getInstance().setCurrentFg(0, 0);
+}
+
+BackgroundCommand::BackgroundCommand(const CommandLine& cmd_line) : BuiltInCommand(cmd_line)
+{
+    if(cmd_line.argsCount() > 1)
+    {
+        std::istringstream arg2(cmd_line.argString(1));
+        arg2 >> job_id_to_bg;
+    }
+}
+
+void BackgroundCommand::execute()
+{
+    int job_id;
+    if(job_id_to_bg) //if we got job id in the input command line
+    {
+        job_id = job_id_to_bg;
+    }
+    else
+    {
+        // re-check just in case a sigcont was sent asynchroniously
+        if(!SmallShell::getInstance().getJobsList()->getLastStoppedJob(&job_id)) 
+        {
+            throw NoStoppedJob("bg");
+        }
+    }
+    JobEntry* jcb = SmallShell::getInstance().getJobsList()->getJobById(job_id);
+    out() << *jcb->command << " : " << jcb->pid << '\n';
+    if(signalChild(jcb->pid, jcb->pidfd, SIGCONT) == -1)
+    {
+        throw SyscallError("kill");
+    }
+    jcb->is_background = true;
+    SmallShell::getInstance().getJobsList()->setJobState(jcb, RUNNING);
+}
+
+RedirectionCommand::RedirectionCommand(const CommandLine& cmd_line, CMD_Type type) : 
+Command(cmd_line, false, 0, false), type(type), left_cmd(NULL), filename(cmd_line.redirectionTarget())
+{
+    try
+    {
+        left_cmd = SmallShell::getInstance().CreateCommand(cmd_line.withoutRedirection());
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+RedirectionCommand::~RedirectionCommand()
+{
+    if(left_cmd)
+    {
+        delete left_cmd;
+    }
+}
+
+/**
+ * The target file is handed to the command as its output instead of being dup2'ed over smash's own stdout:
+ * a builtin writes to it through its output sink and an external command gets it as stdout in the child.
+ * Nothing of smash's state changes, so there is nothing to restore if the command throws.
+ */
+void RedirectionCommand::execute()
+{
+    int write_fd;
+    int flags = O_CREAT | O_WRONLY | O_CLOEXEC | ((type == CMD_Type::OutAppend)? O_APPEND : O_TRUNC);
+    if(type != CMD_Type::OutRed && type != CMD_Type::OutAppend)
+    {
+        return;
+    }
+    if((write_fd = open(filename.c_str(), flags, 0666)) == -1)
+    {
+        throw SyscallError("open");
+    }
+    if(left_cmd)
+    {
+        left_cmd->setOutput(write_fd);
+        try
+        {
+            left_cmd->execute();
+        }
+        catch(const std::exception& e)
+        {
+            left_cmd->setOutput(-1);
+            close(write_fd);
+            throw;
+        }
+        left_cmd->setOutput(-1); // Flushes the builtin's output before the file is closed.
+    }
+    if(close(write_fd) == -1)
+    {
+        throw SyscallError("close");
+    }
+}
+
+PipeCommand::PipeCommand(const CommandLine& cmd_line, CMD_Type type) :
+Command(cmd_line, false, 0, false), type(type)
+{
+    // "|&" feeds the stderr of the stage before it into the pipe.
+    for(std::size_t i = 0; i < cmd_line.stageCount(); i++)
+    {
+        stages.push_back({cmd_line.stage(i), cmd_line.isErrPipe(i)});
+    }
+}
+
+/**
+ * Returns true if the given stage is a plain external command which can be spawned directly,
+ * without forking a smash child to create and run it.
+ */
+bool PipeCommand::isPlainExternal(const CommandLine& stage_line) const
+{
+    if(stage_line.isRedirected() || stage_line.isBackground())
+    {
+        return false;
     }
-    arrayFree(args, n);
+    std::string first_word = stage_line.argString(0);
+    return !SmallShell::getInstance().isBuiltIn(first_word) && first_word != "timeout";
 }
 
-void ChpromptCommand::execute() // chprompt exec
+/**
+ * Returns true if the stage is a builtin which writes only to its stdout and can run inside smash.
+ * Its stderr stays smash's own, so a stage feeding its stderr to the next one ("|&") is not inlined.
+ */
+bool PipeCommand::isInlineStage(const PipeStage& stage) const
 {
-    SmallShell::getInstance().setPrompt(new_prompt);
+    if(stage.err_pipe || stage.line.isRedirected() || stage.line.isBackground())
+    {
+        return false;
+    }
+    return SmallShell::getInstance().isInlineBuiltIn(stage.line.argString(0));
 }
 
-QuitCommand::QuitCommand(const char *cmd_line, std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs)
+/**
+ * Runs a builtin stage inside smash, writing to out_fd (-1 for smash's stdout). Returns its wait status.
+ */
+int PipeCommand::runInlineStage(const PipeStage& stage, int out_fd)
 {
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    if (n > 1) //there is another argument after quit
+    Command* cmd = nullptr;
+    try
     {
-        if(!static_cast<std::string>("kill").compare(args[1]))
+        cmd = SmallShell::getInstance().CreateCommand(stage.line, false);
+        if(cmd)
         {
-            is_kill = true;
+            cmd->setOutput(out_fd);
+            cmd->execute();
+            delete cmd; // Flushes its output sink.
         }
     }
-    arrayFree(args, n);
+    catch(const std::exception& e)
+    {
+        delete cmd;
+        std::cerr << e.what() << std::endl;
+        return W_EXITCODE(1, 0);
+    }
+    return W_EXITCODE(0, 0);
 }
 
-
-void QuitCommand::execute()
+// Ignores SIGPIPE while smash writes into a pipeline itself: a reader that exits early makes the write fail with
+// EPIPE instead of killing smash. Every child is launched before, so none of them inherits the ignored signal.
+class SigpipeGuard
 {
-    if(is_kill)
+    struct sigaction old_action;
+public:
+    SigpipeGuard()
     {
-        jobs->killAllJobs();
+        struct sigaction ignore = {};
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+        sigaction(SIGPIPE, &ignore, &old_action);
     }
-    SmallShell::getInstance().quit_flag = true;
-}
-
-ShowPidCommand::ShowPidCommand(const char *cmd_line) : BuiltInCommand(cmd_line) { }
+    ~SigpipeGuard()
+    {
+        sigaction(SIGPIPE, &old_action, NULL);
+    }
+};
 
-void ShowPidCommand::execute()
+/**
+ * Launches a single stage with its channels replaced according to redirs ((pipe_fd, channel) pairs).
+ * Plain external commands are spawned directly, anything else runs in a forked smash child.
+ * pipe_fds holds every pipe fd of the pipeline, none of them may stay open in the stage.
+ */
+static pid_t _forkStage()
 {
-    std::cout << "smash pid is " << SmallShell::getInstance().getPid() << " " << std::endl;
+    STATS_SCOPE(StatPhase::Spawn);
+    return fork();
 }
 
-GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) { }
-
-void GetCurrDirCommand::execute()
+pid_t PipeCommand::launchStage(const PipeStage& stage, const std::vector<std::pair<int, int>>& redirs, const std::vector<int>& pipe_fds)
 {
-    char buff[COMMAND_ARGS_MAX_LENGTH];
-    if(getcwd(buff, COMMAND_ARGS_MAX_LENGTH) == NULL)
+    if(isPlainExternal(stage.line))
     {
-        std::cerr << SyscallError("getcwd").what() << std::endl;
+        SpawnRequest req;
+        req.dup_fds = redirs;
+        req.close_fds = pipe_fds;
+        return _spawnExternal(stage.line, req);
     }
-    else
+
+    pid_t c_pid;
+    if((c_pid = _forkStage()) == -1)
+    {
+        throw SyscallError("fork");
+    }
+    else if(c_pid == 0) // Child = A smash running the stage command
     {
-        std::cout << buff << std::endl;
+        setpgrp();
+        try
+        {
+            initChildEventLoop(); // A timeout in the stage needs its own alarms.
+            for(auto& redir : redirs)
+            {
+                if(dup2(redir.first, redir.second) == -1)
+                {
+                    throw SyscallError("dup2");
+                }
+            }
+            for(int fd : pipe_fds)
+            {
+                if(close(fd) == -1)
+                {
+                    throw SyscallError("close");
+                }
+            }
+            Command* cmd = SmallShell::getInstance().CreateCommand(stage.line, false);
+            if(cmd)
+            {
+                cmd->execute();
+                delete cmd;
+            }
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            exit(1);
+        }
+        exit(0);
     }
+    return c_pid;
 }
 
-ChangeDirCommand::ChangeDirCommand(const char *cmd_line): BuiltInCommand(cmd_line)
+void PipeCommand::execute()
 {
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    pathname = args[1];
-    arrayFree(args, n);
-}
+    enum pipe_side { PIPE_R = 0, PIPE_W };
+    // Create all the pipes up front: pipe i connects stage i to stage i+1.
+    std::vector<int> pipe_fds;
+    for(std::size_t i = 0; i + 1 < stages.size(); i++)
+    {
+        int fd[2];
+        if(pipe(fd) == -1)
+        {
+            for(int open_fd : pipe_fds)
+            {
+                close(open_fd);
+            }
+            throw SyscallError("pipe");
+        }
+        pipe_fds.push_back(fd[PIPE_R]);
+        pipe_fds.push_back(fd[PIPE_W]);
+    }
 
-void ChangeDirCommand::execute()
-{
-    char current[COMMAND_ARGS_MAX_LENGTH];
-    if (!static_cast<std::string>("-").compare(pathname))
+    // Every other stage is launched directly by the main smash process, inline builtins only run once all of them
+    // are up: the stage reading their output must already be draining the pipe.
+    std::vector<bool> inline_stage(stages.size());
+    bool has_inline = false;
+    for(std::size_t i = 0; i < stages.size(); i++)
+    {
+        inline_stage[i] = isInlineStage(stages[i]);
+        has_inline |= inline_stage[i];
+    }
+    std::shared_ptr<JobsList> jobs = SmallShell::getInstance().getJobsList();
+    if(has_inline)
     {
-        if(getcwd(current, COMMAND_ARGS_MAX_LENGTH) == NULL)
+        jobs->updateAllJobs(); // Nothing reaps from here until the stages are waited for, not even an inline "jobs".
+    }
+    std::vector<pid_t> pids;
+    try
+    {
+        for(std::size_t i = 0; i < stages.size(); i++)
         {
-            throw SyscallError("getcwd");
+            if(inline_stage[i])
+            {
+                continue;
+            }
+            std::vector<std::pair<int, int>> redirs;
+            if(i > 0)
+            {
+                redirs.push_back(std::make_pair(pipe_fds[2 * (i - 1) + PIPE_R], STDIN_FILENO));
+            }
+            if(i + 1 < stages.size())
+            {
+                redirs.push_back(std::make_pair(pipe_fds[2 * i + PIPE_W], stages[i].err_pipe? STDERR_FILENO : STDOUT_FILENO));
+            }
+            pids.push_back(launchStage(stages[i], redirs, pipe_fds));
         }
-        if (chdir((SmallShell::getInstance().getLastPwd()).c_str()) == -1) // Attempt to change the dir to the previous one
+    }
+    catch(const std::exception& e)
+    {
+        for(pid_t stage_pid : pids)
         {
-            throw SyscallError("chdir");
+            kill(stage_pid, SIGKILL);
         }
-        // On success, replace the previous dir with the current one (on the smash memory)
-        
-        SmallShell::getInstance().setLastPwd(current);
+        for(int fd : pipe_fds)
+        {
+            close(fd);
+        }
+        for(pid_t stage_pid : pids)
+        {
+            waitpid(stage_pid, NULL, 0);
+        }
+        throw;
     }
-    else
+
+    // Father = The main smash process. It keeps only the write ends of the inline stages, an inline stage does not
+    // read its stdin: the stage before it gets EPIPE (or EOF) like with a command that never reads.
+    bool close_failed = false;
+    for(std::size_t i = 0; i < pipe_fds.size(); i++)
     {
-        if(getcwd(current, COMMAND_ARGS_MAX_LENGTH) == NULL)
+        if(i % 2 == PIPE_W && inline_stage[i / 2])
         {
-            throw SyscallError("getcwd");
+            continue;
         }
-        if ((chdir(pathname.c_str()))==-1)
+        close_failed |= (close(pipe_fds[i]) == -1);
+    }
+    int inline_status = 0;
+    if(has_inline)
+    {
+        SigpipeGuard guard;
+        for(std::size_t i = 0; i < stages.size(); i++)
         {
-            throw SyscallError("chdir");
+            if(!inline_stage[i])
+            {
+                continue;
+            }
+            bool last = (i + 1 == stages.size());
+            inline_status = runInlineStage(stages[i], last? -1 : pipe_fds[2 * i + PIPE_W]);
+            if(!last)
+            {
+                close_failed |= (close(pipe_fds[2 * i + PIPE_W]) == -1); // EOF for the next stage
+            }
         }
-        SmallShell::getInstance().setLastPwd(current);
     }
+    if(close_failed)
+    {
+        throw SyscallError("close");
+    }
+    // Wait for all the stages at once, each one's exit wakes the wait through its pidfd.
+    std::vector<int> pidfds;
+    for(pid_t stage_pid : pids)
+    {
+        pidfds.push_back(openPidfd(stage_pid));
+    }
+    int last_status = 0;
+    struct rusage usage = {};
+    bool wait_failed = !waitChildren(pids, pidfds, WUNTRACED, &last_status, &usage);
+    if(inline_stage.back())
+    {
+        last_status = inline_status;
+    }
+    jobs->recordForeground(last_status, usage);
+    for(int pidfd : pidfds)
+    {
+        if(pidfd != -1)
+        {
+            close(pidfd);
+        }
+    }
+    if(wait_failed)
+    {
+        throw SyscallError("wait4");
+    }
+}
+//***************SMASH IMPLEMENTATION***************//
+SmallShell::SmallShell() : main_pid(getpid()), prompt("smash"), quit_flag(false), last_pwd(""), jobs(std::make_shared<JobsList>(JobsList())),
+alarm_list(std::make_shared<AlarmList>()), fg_job_id(0)
+{
+    registerBuiltin("chprompt", _createChprompt);
+    // Builtins that only print (no shell state changes, no waiting, no stdin) can run inline as pipeline stages.
+    registerBuiltin("showpid", _createShowPid, true);
+    registerBuiltin("pwd", _createPwd, true);
+    registerBuiltin("cd", _createCd);
+    registerBuiltin("jobs", _createJobs, true);
+    registerBuiltin("kill", _createKill);
+    registerBuiltin("fg", _createFg);
+    registerBuiltin("bg", _createBg);
+    registerBuiltin("quit", _createQuit);
+    registerBuiltin("cat", _createCat, true);
+    registerBuiltin("stats", _createStats);
+    registerBuiltin("parallel", _createParallel);
 }
 
-JobsCommand::JobsCommand(const char *cmd_line, std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs) { }
+SmallShell::~SmallShell() { }
 
-void JobsCommand::execute()
+const std::string& SmallShell::getPrompt() const
+{
+    return prompt;
+}
+
+void SmallShell::setPrompt(const std::string& new_prompt)
 {
-    jobs->printJobsList();
+    prompt = new_prompt;
 }
 
-KillCommand::KillCommand(const char *cmd_line, int signum, int job_id, std::shared_ptr<JobsList> jobs) :
-BuiltInCommand(cmd_line), signum(signum), job_id(job_id), jobs(jobs) { }
+pid_t SmallShell::getPid() const
+{
+    return main_pid;
+}
 
-void KillCommand::execute()
+bool SmallShell::isBuiltIn(const std::string& cmd_name) const
+{
+    return builtins.count(cmd_name) != 0;
+}
+
+bool SmallShell::isInlineBuiltIn(const std::string& cmd_name) const
+{
+    return inline_builtins.count(cmd_name) != 0;
+}
+
+/**
+ * Adds (or replaces) a builtin: a foreground line whose first word is name is created by factory.
+ * With inline_stage, a pipeline runs it inside smash instead of forking a smash child for it.
+ */
+void SmallShell::registerBuiltin(const std::string& name, BuiltinFactory factory, bool inline_stage)
 {
-    pid_t to_signal = jobs->getJobById(job_id)->pid;
-    if(kill(to_signal, signum) == -1)
+    builtins[name] = factory;
+    if(inline_stage)
     {
-        perror("smash error: kill failed");
+        inline_builtins.insert(name);
     }
     else
     {
-        std::cout << "signal number " << signum << " was sent to pid " << to_signal << std::endl;
+        inline_builtins.erase(name);
     }
 }
 
-ExternalCommand::ExternalCommand(const char* cmd_line, bool is_background, bool valid_job, bool to_wait) : 
-Command(cmd_line, is_background, pid, valid_job, to_wait), is_background(is_background), stripped_cmd("")
-{ 
-    if(is_background)
-    {
-        char* tmp;
-        if(!(tmp = strdup(cmd_line)))
-        {
-            throw std::bad_alloc();
-        }
-        _removeBackgroundSign(tmp);
-        stripped_cmd = std::string(tmp);
-        free(tmp);
-    }
+bool SmallShell::getQuitFlag() const
+{
+    return quit_flag;
 }
 
-void ExternalCommand::execute()
+std::shared_ptr<JobsList> SmallShell::getJobsList()
 {
-    char args_line[COMMAND_ARGS_MAX_LENGTH], bash[] = "/bin/bash", c_flag[] = "-c";
-    pid_t c_pid;
+    return jobs;
+}
 
-    if((c_pid = fork()) == -1)
-    {
-        throw SyscallError("fork");
-    }
-    else if(c_pid == 0) // Child
-    {
-        setpgrp();
-        strcpy(args_line, is_background? stripped_cmd.c_str() : cmd_text.c_str());
-        char *exec_args[] = {bash, c_flag, args_line, NULL};
-        if(execvp("/bin/bash", exec_args) == -1)
-        {
-            throw SyscallError("execvp");
-        }
-    }
-    else 
-    {
-        this->pid = c_pid;
-        std::shared_ptr<JobEntry> jcb_ptr = nullptr;
-        if(this->valid_job) jcb_ptr = SmallShell::getInstance().getJobsList()->addJob(this);
+std::shared_ptr<AlarmList> SmallShell::getAlarmList()
+{
+    return alarm_list;
+}
 
-        if(!is_background && to_wait)
-        {
-            SmallShell::getInstance().setCurrentFg(jcb_ptr == nullptr? 0 : jcb_ptr->job_id, this->pid); // Set the current fg
-            if(waitpid(pid, NULL, WUNTRACED) == -1)
-            {
-                throw SyscallError("waitpid");
-            }
-            SmallShell::getInstance().setCurrentFg(0, 0); // Reset the current fg
-        }
-    }
+PathCache& SmallShell::getPathCache()
+{
+    return path_cache;
 }
 
-TimeoutCommand::TimeoutCommand(const char *cmd_line, bool is_background, int duration, bool valid_job) :
-ExternalCommand(cmd_line, is_background, valid_job), duration(duration), command(NULL)
-{ 
-    std::istringstream ss(cmd_line);
-    std::string extracted_cmd;
-    ss >> extracted_cmd; ss >> extracted_cmd;
-    std::getline(ss, extracted_cmd);
-    extracted_cmd = _trim(extracted_cmd);
+int SmallShell::getCurrentFgJobId() const
+{
+    return fg_job_id;
+}
 
-    command = SmallShell::getInstance().CreateCommand(extracted_cmd.c_str(), false, false);
+pid_t SmallShell::getCurrentFgPid() const
+{
+    return fg_pid;
 }
 
-void TimeoutCommand::execute()
+void SmallShell::setCurrentFg(int job_id, pid_t j_pid)
 {
-    command->execute();
-    this->pid = command->getPid();
-    std::shared_ptr<JobEntry> jcb_ptr = nullptr;
-    if(this->valid_job) jcb_ptr = SmallShell::getInstance().getJobsList()->addJob(this);
+    fg_job_id = job_id;
+    fg_pid = j_pid;
+}
 
-    SmallShell& smash = SmallShell::getInstance();
-    time_t curr_time = time(NULL);
-    time_t new_time = curr_time + duration;
-    AlarmEntry acb = 
-    {
-        .finish_time = new_time,
-        .pid = this->pid,
-        .cmd_text = this->cmd_text
-    };
-    smash.getAlarmList()->push_front(acb);
-    smash.getAlarmList()->sort([](const AlarmEntry &a, const AlarmEntry &b) { return a < b; });
-    if(difftime(smash.getAlarmList()->front().finish_time, curr_time) > 0)
+const std::vector<pid_t>* SmallShell::getCurrentFgBatch() const
+{
+    return fg_batch;
+}
+
+/**
+ * Makes pids (owned by the caller) the children ctrl-C and ctrl-Z act on, when no single foreground job is set.
+ * The handlers reset it to nullptr, which tells the caller to stop starting new children.
+ */
+void SmallShell::setCurrentFgBatch(const std::vector<pid_t>* pids)
+{
+    fg_batch = pids;
+}
+
+//*************ALARM LIST IMPLEMENTATION*************//
+/**
+ * Blocks SIGALRM for the lifetime of the object, so the alarm handler never sees the list mid-update.
+ */
+class AlarmBlocker
+{
+    sigset_t old_mask;
+public:
+    AlarmBlocker()
     {
-        alarm(difftime(smash.getAlarmList()->front().finish_time, curr_time));
+        sigset_t alarm_mask;
+        sigemptyset(&alarm_mask);
+        sigaddset(&alarm_mask, SIGALRM);
+        sigprocmask(SIG_BLOCK, &alarm_mask, &old_mask);
     }
-    
-    if(!is_background && to_wait)
+    ~AlarmBlocker()
     {
-        smash.setCurrentFg(jcb_ptr == nullptr? 0 : jcb_ptr->job_id, this->pid); // Set the current fg
-        if(waitpid(pid, NULL, WUNTRACED) == -1)
-        {
-            throw SyscallError("waitpid");
-        }
-        smash.setCurrentFg(0, 0); // Reset the current fg.
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
     }
-}
+};
 
-CatCommand::CatCommand(const char *cmd_line) : BuiltInCommand(cmd_line)
+AlarmList::~AlarmList()
 {
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    for(int i = 1; i < n; i++)
+    for(auto& pair : alarms)
     {
-        if(args[i] != NULL)
+        if(pair.second.pidfd != -1)
         {
-            f_queue.emplace(args[i]);
+            close(pair.second.pidfd);
         }
     }
-    arrayFree(args, n);
+    if(timer_created)
+    {
+        timer_delete(timer);
+    }
 }
 
-void CatCommand::execute()
+void AlarmList::addAlarm(pid_t pid, const CmdText& cmd_text, long long duration_ns)
 {
-    std::string curr_file;
-    char buffer[READ_BUFFER_SIZE];
-    int fd = 0, read_res = 1;
-
-    while(!f_queue.empty()) // Repeat until the queue is empty
+    AlarmBlocker blocker;
+    if(!timer_created)
     {
-        curr_file = f_queue.front();
-        f_queue.pop();
-        read_res = 1; // Might be superfluous.
-
-        if((fd = open(curr_file.c_str(), O_RDONLY)) == -1)
-        {
-            throw SyscallError("open");
-        }
-        while((read_res = read(fd, buffer, READ_BUFFER_SIZE)))
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIGALRM;
+        if(timer_create(CLOCK_MONOTONIC, &sev, &timer) == -1)
         {
-            if(read_res == -1)
-            {
-                throw SyscallError("read");
-            }
-            if(write(STDOUT_FILENO, buffer, read_res) == -1)
-            {
-                throw SyscallError("write");
-            }
+            throw SyscallError("timer_create");
         }
+        timer_created = true;
     }
-}
 
-
-ForegroundCommand::ForegroundCommand(const char *cmd_line) : BuiltInCommand(cmd_line)
-{
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    if(n > 1)
+    cancelAlarm(pid); // A pid has at most one pending alarm.
+    long long finish_time = monotonicNs() + duration_ns;
+    AlarmEntry acb = {finish_time, pid, openPidfd(pid), cmd_text};
+    pid_index[pid] = alarms.insert(std::make_pair(finish_time, acb));
+    if(alarms.begin()->second.pid == pid) // The new alarm is the nearest one.
     {
-        std::istringstream arg2(args[1]);
-        arg2 >> job_id_to_fg;
+        rearm();
     }
-    arrayFree(args, n);
 }
 
-void ForegroundCommand::execute()
+/**
+ * Removes the pending alarm of pid, if there is one (e.g. the process finished before its deadline).
+ */
+void AlarmList::cancelAlarm(pid_t pid)
 {
-    int job_id;
-    if (job_id_to_fg) //if we got job id in the input command line
+    AlarmBlocker blocker;
+    auto it = pid_index.find(pid);
+    if(it == pid_index.end())
     {
-        job_id = job_id_to_fg;
-    }
-    else
-    {
-        SmallShell::getInstance().getJobsList()->getLastJob(&job_id);
+        return;
     }
-    const std::shared_ptr<JobEntry>& jcb = SmallShell::getInstance().getJobsList()->getJobById(job_id);
-    std::cout << jcb->command << " : " << jcb->pid << std::endl;
-    
-    SmallShell::getInstance().setCurrentFg(job_id, jcb->pid);
-    if(jcb->state==STOPPED)
+    bool was_first = (it->second == alarms.begin());
+    if(it->second->second.pidfd != -1)
     {
-        if (kill(jcb->pid, SIGCONT) == -1)
-        {
-            throw SyscallError("kill");
-        }
-        jcb->state = RUNNING;
+        close(it->second->second.pidfd);
     }
-    jcb->is_background = false;
-    if(waitpid(jcb->pid, NULL, WUNTRACED) == -1)
+    alarms.erase(it->second);
+    pid_index.erase(it);
+    if(was_first)
     {
-        throw SyscallError("waitpid");
+        rearm();
     }
-    SmallShell::getInstance().setCurrentFg(0, 0);
 }
 
-BackgroundCommand::BackgroundCommand(const char *cmd_line) : BuiltInCommand(cmd_line)
+/**
+ * Pops the nearest alarm into entry if its deadline has passed, the caller then owns entry->pidfd.
+ * Returns false if there is no expired alarm.
+ */
+bool AlarmList::popExpired(AlarmEntry* entry)
 {
-    char *args[COMMAND_MAX_ARGS];
-    int n;
-    _processCommandLine(cmd_line, args, &n);
-    if(n > 1)
+    if(alarms.empty() || alarms.begin()->first > monotonicNs())
     {
-        std::istringstream arg2(args[1]);
-        arg2 >> job_id_to_bg;
+        return false;
     }
-    arrayFree(args, n);
+    *entry = alarms.begin()->second;
+    pid_index.erase(entry->pid);
+    alarms.erase(alarms.begin());
+    return true;
 }
 
-void BackgroundCommand::execute()
+/**
+ * Arms the timer for the nearest deadline, or disarms it if there are no pending alarms.
+ */
+void AlarmList::rearm()
 {
-    int job_id;
-    if(job_id_to_bg) //if we got job id in the input command line
+    if(!timer_created)
     {
-        job_id = job_id_to_bg;
+        return;
     }
-    else
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if(!alarms.empty())
     {
-        // re-check just in case a sigcont was sent asynchroniously
-        if(!SmallShell::getInstance().getJobsList()->getLastStoppedJob(&job_id)) 
-        {
-            throw NoStoppedJob("bg");
-        }
+        long long next_time = alarms.begin()->first;
+        spec.it_value.tv_sec = next_time / 1000000000LL;
+        spec.it_value.tv_nsec = next_time % 1000000000LL;
     }
-    const std::shared_ptr<JobEntry>& jcb = SmallShell::getInstance().getJobsList()->getJobById(job_id);
-    std::cout << jcb->command << " : " << jcb->pid << std::endl;
-    if(kill(jcb->pid, SIGCONT) == -1)
+    if(timer_settime(timer, TIMER_ABSTIME, &spec, NULL) == -1)
     {
-        throw SyscallError("kill");
+        perror("smash error: timer_settime failed");
     }
-    jcb->is_background = true;
-    jcb->state = RUNNING;
 }
 
-RedirectionCommand::RedirectionCommand(const char *cmd_line, CMD_Type type) : 
-Command(cmd_line, false, 0, false), type(type), left_cmd(NULL), stdout_backup(0), write_fd(0), filename("")
+/**
+ * In a forked child: drops smash's alarms (they are for smash's children) and its timer, which fork does not copy.
+ * The next addAlarm() creates the child's own timer.
+ */
+void AlarmList::forgetInherited()
 {
-    // Create the command and file name by manipulating the std::string library:
-    std::size_t op_first_pos = cmd_text.find_first_of('>');
-    try
-    {
-        left_cmd = SmallShell::getInstance().CreateCommand(cmd_text.substr(0, op_first_pos).c_str());
-    }
-    catch(const std::exception& e)
+    for(auto& pair : alarms)
     {
-        std::cerr << e.what() << std::endl;
+        if(pair.second.pidfd != -1)
+        {
+            close(pair.second.pidfd);
+        }
     }
-    filename = _trim(cmd_text.substr(op_first_pos + (type == CMD_Type::OutAppend) + 1));
+    alarms.clear();
+    pid_index.clear();
+    timer_created = false;
 }
 
-RedirectionCommand::~RedirectionCommand()
+bool AlarmList::isEmpty() const
 {
-    if(left_cmd)
+    return alarms.empty();
+}
+
+//*************PATH CACHE IMPLEMENTATION*************//
+/**
+ * Drops all the cached entries if PATH changed since the last lookup.
+ */
+void PathCache::refresh()
+{
+    const char* curr_path = getenv("PATH");
+    std::string new_path(curr_path ? curr_path : "/bin:/usr/bin"); // Same default execvp uses.
+    if(new_path != path_env)
     {
-        delete left_cmd;
+        path_env = new_path;
+        cache.clear();
     }
 }
 
-void RedirectionCommand::prepare()
+void PathCache::invalidate()
+{
+    cache.clear();
+}
+
+/**
+ * Resolves prog_name to an executable file the same way execvp would, caching the result.
+ * Returns true and puts the path in full_path if an executable was found, otherwise returns false.
+ */
+bool PathCache::resolve(const std::string& prog_name, std::string& full_path)
 {
-    if((stdout_backup = dup(STDOUT_FILENO)) == -1) // Backup the stdout channel
+    if(prog_name.find('/') != std::string::npos) // Explicit path, no lookup needed.
     {
-        throw SyscallError("dup");
+        full_path = prog_name;
+        return access(prog_name.c_str(), X_OK) == 0;
     }
-    if(dup2(write_fd, STDOUT_FILENO) == -1) // Override the stdout channel with the file given by the user.
+
+    refresh();
+    auto it = cache.find(prog_name);
+    if(it != cache.end())
     {
-        throw SyscallError("dup2");
+        if(access(it->second.c_str(), X_OK) == 0)
+        {
+            full_path = it->second;
+            return true;
+        }
+        cache.erase(it); // Stale entry, look it up again.
     }
-    if(close(write_fd) == -1) // Close the old fd of the file give by the user.
+
+    std::size_t start = 0;
+    while(start <= path_env.size())
     {
-        throw SyscallError("close");
+        std::size_t end = path_env.find(':', start);
+        if(end == std::string::npos)
+        {
+            end = path_env.size();
+        }
+        std::string dir = path_env.substr(start, end - start);
+        std::string candidate = (dir.empty()? "." : dir) + "/" + prog_name;
+        if(access(candidate.c_str(), X_OK) == 0)
+        {
+            cache[prog_name] = candidate;
+            full_path = candidate;
+            return true;
+        }
+        start = end + 1;
     }
+    return false;
 }
 
-void RedirectionCommand::cleanup()
+//*************JOBSLIST IMPLEMENTATION*************//
+JobsList::JobsList() : slots(1) { }
+
+JobEntry* JobsList::addJob(Command *cmd, bool isStopped)
 {
-    if(dup2(stdout_backup, STDOUT_FILENO) == -1)
+    int job_id = slots.size(); // max job_id + 1 (or 1 if there are no jobs), as there are no free slots at the end.
+    j_state state = isStopped? j_state::STOPPED : j_state::RUNNING;
+    bool is_background = cmd->isBackground();
+    slots.push_back({job_id, cmd->getPid(), cmd->getCmdText(), time(NULL), state, is_background, 0, {}, openPidfd(cmd->getPid()), true, 0, 0});
+    JobEntry* jcb = &slots.back(); // A deque never moves its elements on push_back/pop_back.
+    pid_index[jcb->pid] = job_id;
+    jobs_count++;
+    if(isStopped)
     {
-        throw SyscallError("dup2");
+        linkStopped(job_id);
     }
-    if(close(stdout_backup) == -1)
+    if(!is_background && !isStopped)
     {
-        throw SyscallError("close");
+        SmallShell::getInstance().setCurrentFg(job_id, jcb->pid);
     }
+    return jcb;
 }
 
-void RedirectionCommand::execute()
+void JobsList::removeJob(int job_id)
 {
-    switch(type)
+    JobEntry* jcb = getJobById(job_id);
+    if(jcb)
     {
-        case CMD_Type::OutRed:
+        if(jcb->state == j_state::STOPPED)
         {
-            if((write_fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666)) == -1)
-            {
-                throw SyscallError("open");
-            }
-            break;
+            unlinkStopped(job_id);
         }
-        case CMD_Type::OutAppend:
+        pid_index.erase(jcb->pid);
+        if(jcb->pidfd != -1)
         {
-            if((write_fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0666)) == -1)
-            {
-                throw SyscallError("open");
-            }
-            break;
+            close(jcb->pidfd);
+        }
+        jcb->in_use = false;
+        jcb->command.reset();
+        jobs_count--;
+        while(slots.size() > 1 && !slots.back().in_use) // Drop the free slots at the end.
+        {
+            slots.pop_back();
         }
-        default:
-            return;
     }
-    if(left_cmd)
+    if(job_id == SmallShell::getInstance().getCurrentFgJobId())
     {
-        prepare();
-
-        left_cmd->execute();
-
-        cleanup();
+        SmallShell::getInstance().setCurrentFg(0, 0);
     }
-    else
+}
+
+/**
+ * Inserts a job into the stopped list, keeping it sorted by job id.
+ * A job being stopped is usually the newest one, so the walk from the tail normally stops right away.
+ */
+void JobsList::linkStopped(int job_id)
+{
+    int prev = stopped_tail;
+    while(prev && prev > job_id)
     {
-        if(close(write_fd) == -1)
-        {
-            throw SyscallError("close");
-        }
+        prev = slots[prev].prev_stopped;
     }
+    int next = prev? slots[prev].next_stopped : stopped_head;
+    slots[job_id].prev_stopped = prev;
+    slots[job_id].next_stopped = next;
+    (prev? slots[prev].next_stopped : stopped_head) = job_id;
+    (next? slots[next].prev_stopped : stopped_tail) = job_id;
 }
 
-PipeCommand::PipeCommand(const char *cmd_line, CMD_Type type) :
-Command(cmd_line, false, 0, false), type(type), left_cmd(NULL), right_cmd(NULL) { }
+void JobsList::unlinkStopped(int job_id)
+{
+    int prev = slots[job_id].prev_stopped, next = slots[job_id].next_stopped;
+    (prev? slots[prev].next_stopped : stopped_head) = next;
+    (next? slots[next].prev_stopped : stopped_tail) = prev;
+    slots[job_id].prev_stopped = slots[job_id].next_stopped = 0;
+}
 
-PipeCommand::~PipeCommand()
+/**
+ * Changes the state of a job, keeping the stopped list up to date.
+ */
+void JobsList::setJobState(JobEntry* jcb, j_state state)
 {
-    if(left_cmd)
+    if(jcb->state == state)
     {
-        delete left_cmd;
+        return;
     }
-    if(right_cmd)
+    if(jcb->state == j_state::STOPPED)
     {
-        delete right_cmd;
+        unlinkStopped(jcb->job_id);
+    }
+    jcb->state = state;
+    if(state == j_state::STOPPED)
+    {
+        linkStopped(jcb->job_id);
     }
 }
 
-void PipeCommand::execute()
+volatile sig_atomic_t JobsList::children_changed = 0;
+
+/**
+ * Called from the SIGCHLD handler: only marks that some child changed its state.
+ */
+void JobsList::notifyChildChanged()
 {
-    pid_t l_pid, r_pid;
-    enum pipe_side { PIPE_R = 0, PIPE_W };
-    std::size_t op_first_pos = cmd_text.find_first_of('|');
-    int fd[2];
-    
-    if(pipe(fd) == -1)
-    {
-        throw SyscallError("pipe");
-    }
+    children_changed = 1;
+}
 
-    if((l_pid = fork()) == -1)
+/**
+ * Applies a single status change (as returned by waitpid) of the child j_pid to the jobs list.
+ */
+void JobsList::applyChildStatus(pid_t j_pid, int status, const struct rusage* usage)
+{
+    if(WIFEXITED(status) || WIFSIGNALED(status)) // A finished process can no longer time out.
     {
-        throw SyscallError("fork");
+        SmallShell::getInstance().getAlarmList()->cancelAlarm(j_pid);
     }
-    else if(l_pid == 0) // Child = Left command
+    auto watch = watched.find(j_pid);
+    if(watch != watched.end())
     {
-        setpgrp();
-        try
-        {
-            if(dup2(fd[PIPE_W], type == CMD_Type::Pipe? STDOUT_FILENO : STDERR_FILENO) == -1)
-            {
-                throw SyscallError("dup2");
-            }
-            if(close(fd[PIPE_W]) == -1 || close(fd[PIPE_R]) == -1)
-            {
-                throw SyscallError("close");
-            }
-            left_cmd = SmallShell::getInstance().CreateCommand(cmd_text.substr(0, op_first_pos).c_str(), false);
-            left_cmd->execute();
-        }
-        catch(const std::exception& e)
+        watch->second.changed = !WIFCONTINUED(status);
+        watch->second.status = status;
+        if(usage)
         {
-            std::cerr << e.what() << std::endl;
-            exit(1);
+            watch->second.usage = *usage;
         }
-        exit(0);
     }
-
-    if((r_pid = fork()) == -1)
+    JobEntry* jcb = getJobByPid(j_pid);
+    if(!jcb) // Not a job (pipe stage, timeout's inner command, etc.)
     {
-        if(kill(l_pid, SIGKILL) == -1)
-        {
-            throw SyscallError("kill");
-        }
-        throw SyscallError("fork");
+        return;
     }
-    else if(r_pid == 0) // Child = Right command
+    jcb->status = status;
+    if(WIFEXITED(status) || WIFSIGNALED(status)) // If the job is dead, keep its results for "jobs -l" and remove it.
     {
-        setpgrp();
-        try
+        if(usage)
         {
-            if(dup2(fd[PIPE_R], STDIN_FILENO) == -1)
-            {
-                throw SyscallError("dup2");
-            }
-            if(close(fd[PIPE_W]) == -1 || close(fd[PIPE_R]) == -1)
-            {
-                throw SyscallError("close");
-            }
-            right_cmd = SmallShell::getInstance().CreateCommand(cmd_text.substr(op_first_pos + (type == CMD_Type::ErrPipe) + 1).c_str(), false);
-            right_cmd->execute();
+            jcb->usage = *usage;
         }
-        catch(const std::exception& e)
+        finished.push_back(*jcb);
+        finished.back().pidfd = -1;
+        if(finished.size() > FINISHED_JOBS_MAX)
         {
-            std::cerr << e.what() << std::endl;
-            exit(1);
+            finished.pop_front();
         }
-        exit(0);
-    }
-
-    // Father = The main smash process
-    if(close(fd[PIPE_W]) == -1 || close(fd[PIPE_R]) == -1)
-    {
-        throw SyscallError("close");
+        removeJob(jcb->job_id);
     }
-    if(waitpid(l_pid, NULL, WUNTRACED) == -1)
+    else if(WIFSTOPPED(status)) // If job is only stopped, update it's status.
     {
-        throw SyscallError("waitpid");
+        if(jcb->state == j_state::RUNNING)
+        {
+            jcb->start_time = time(NULL);
+        }
+        setJobState(jcb, j_state::STOPPED);
     }
-    if(waitpid(r_pid, NULL, WUNTRACED) == -1)
+    else if(WIFCONTINUED(status))
     {
-        throw SyscallError("waitpid");
+        setJobState(jcb, j_state::RUNNING);
     }
 }
-//***************SMASH IMPLEMENTATION***************//
-SmallShell::~SmallShell() { }
 
-const std::string& SmallShell::getPrompt() const
+/**
+ * Keeps the next exit or stop of pid for takeWatchedStatus(), whoever reaps it.
+ */
+void JobsList::watchChild(pid_t pid)
 {
-    return prompt;
+    watched[pid] = WatchedChild();
 }
 
-void SmallShell::setPrompt(const std::string& new_prompt)
+void JobsList::unwatchChild(pid_t pid)
 {
-    prompt = new_prompt;
+    watched.erase(pid);
 }
 
-pid_t SmallShell::getPid() const
+/**
+ * Returns true, with its status and rusage, if the watched child pid exited or stopped and was reaped by someone else.
+ */
+bool JobsList::takeWatchedStatus(pid_t pid, int* status, struct rusage* usage)
 {
-    return main_pid;
+    auto watch = watched.find(pid);
+    if(watch == watched.end() || !watch->second.changed)
+    {
+        return false;
+    }
+    watch->second.changed = false;
+    *status = watch->second.status;
+    if(usage)
+    {
+        *usage = watch->second.usage;
+    }
+    return true;
 }
 
-bool SmallShell::isBuiltIn(const char* cmd_line) const
+/**
+ * Reaps only the children that changed state since the last call, as reported by SIGCHLD.
+ * Costs nothing when no child changed.
+ */
+void JobsList::updateAllJobs() 
 {
-    string cmd_s = _trim(string(cmd_line));
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
-    if(builtin_set.count(firstWord))
+    if(!children_changed)
     {
-        return true;
+        return;
     }
-    return false;
-}
+    children_changed = 0; // Cleared before reaping, so a SIGCHLD arriving meanwhile is not lost.
+    STATS_SCOPE(StatPhase::Reap);
 
-bool SmallShell::getQuitFlag() const
-{
-    return quit_flag;
+    int status = 0;
+    struct rusage usage;
+    pid_t changed_pid;
+    while((changed_pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        applyChildStatus(changed_pid, status, &usage);
+    }
 }
 
-std::shared_ptr<JobsList> SmallShell::getJobsList()
+/**
+ * Blocks until the child j_pid exits or stops, applies the change to the jobs list and returns its status.
+ */
+int JobsList::waitForeground(pid_t j_pid)
 {
-    return jobs;
+    int status = 0;
+    JobEntry* jcb = getJobByPid(j_pid);
+    // A private copy: the job (and its pidfd) may be removed by a signal handled during the wait.
+    int pidfd = (jcb && jcb->pidfd != -1)? fcntl(jcb->pidfd, F_DUPFD_CLOEXEC, 0) : -1;
+    struct rusage usage = {};
+    pid_t res = waitChild(j_pid, pidfd, &status, WUNTRACED, &usage);
+    if(pidfd != -1)
+    {
+        close(pidfd);
+    }
+    if(res == -1)
+    {
+        throw SyscallError("wait4");
+    }
+    applyChildStatus(j_pid, status, &usage);
+    recordForeground(status, usage);
+    return status;
 }
 
-std::shared_ptr<std::list<AlarmEntry>> SmallShell::getAlarmList()
+/**
+ * Keeps the status of the last foreground command and adds its rusage to the one collected since resetLastUsage().
+ */
+void JobsList::recordForeground(int status, const struct rusage& usage)
 {
-    return alarm_list;
+    last_status = status;
+    timeradd(&last_usage.ru_utime, &usage.ru_utime, &last_usage.ru_utime);
+    timeradd(&last_usage.ru_stime, &usage.ru_stime, &last_usage.ru_stime);
+    if(usage.ru_maxrss > last_usage.ru_maxrss)
+    {
+        last_usage.ru_maxrss = usage.ru_maxrss;
+    }
+    last_usage.ru_nvcsw += usage.ru_nvcsw;
+    last_usage.ru_nivcsw += usage.ru_nivcsw;
 }
 
-int SmallShell::getCurrentFgJobId() const
+void JobsList::resetLastUsage()
 {
-    return fg_job_id;
+    memset(&last_usage, 0, sizeof(last_usage));
 }
 
-pid_t SmallShell::getCurrentFgPid() const
+int JobsList::getLastStatus() const
 {
-    return fg_pid;
+    return last_status;
 }
 
-void SmallShell::setCurrentFg(int job_id, pid_t j_pid)
+const struct rusage& JobsList::getLastUsage() const
 {
-    fg_job_id = job_id;
-    fg_pid = j_pid;
+    return last_usage;
 }
 
-//*************JOBSLIST IMPLEMENTATION*************//
-std::shared_ptr<JobEntry> JobsList::addJob(Command *cmd, bool isStopped)
-{
-    /*
-        struct JobEntry
-        {
-            int job_id;
-            int pid;
-            std::string command;
-            time_t start_time;
-            j_state state;
-            bool background;
-        };
-    */
-    int job_id;
-    if(jobs.size() == 0) // In case there are no current jobs running.
-    {
-        job_id = 1;
-    }
-    else // Otherwise: max job_id + 1
-    {
-        job_id = jobs.rbegin()->first + 1;
-    }
-    int pid = cmd->getPid();
-    std::string command = cmd->getCmdLine();
-    time_t start_time = time(NULL);
-    j_state state = isStopped? j_state::STOPPED : j_state::RUNNING;
-    bool is_background = cmd->isBackground();
-    JobEntry jcb = {job_id, pid, command, start_time, state, is_background}; // Create the JCB template.
-    std::shared_ptr<JobEntry> jcb_ptr = std::make_shared<JobEntry>(jcb);
-    jobs[job_id] = jcb_ptr; // Add the new job to the jobs map. (AS A SHARED_PTR)
-    if(!is_background && !isStopped)
+/**
+ * Prints the jobs that finished since the last call, with their exit status and resource usage, and forgets them.
+ */
+void JobsList::printFinishedJobs(std::ostream& out)
+{
+    for(auto& jcb : finished)
     {
-        SmallShell::getInstance().setCurrentFg(job_id, pid);
+        out << "[" << jcb.job_id << "] " << *jcb.command << " : " << jcb.pid << " " << describeStatus(jcb.status) << " ";
+        printUsage(out, jcb.usage);
+        out << '\n';
     }
-    return jcb_ptr;
+    finished.clear();
 }
 
-void JobsList::removeJob(int job_id)
+void JobsList::printJobsList(std::ostream& out)
 {
-    if(jobs.count(job_id))
-    {
-        jobs.erase(job_id);
-    }
-    if(job_id == SmallShell::getInstance().getCurrentFgJobId())
+    updateAllJobs();
+    auto now = time(NULL);
+    for(auto& jcb : slots)
     {
-        SmallShell::getInstance().setCurrentFg(0, 0);
+        if(!jcb.in_use)
+        {
+            continue;
+        }
+        out << "[" << jcb.job_id << "] " << *jcb.command << " : " << jcb.pid << " " << difftime(now, jcb.start_time) << " secs" \
+            << ((jcb.state == j_state::STOPPED)? " (stopped)" : "") << '\n';
     }
 }
 
-void JobsList::updateAllJobs() 
+/**
+ * Ends every job and empties the list. signum goes to the process group of every job at once (stopped jobs are also
+ * continued, to act on it), then all of them are waited for together: with grace_ns, the ones still running after it
+ * are killed with SIGKILL. Every job is reaped (for at most QUIT_KILL_WAIT_NS after SIGKILL), so the whole shutdown
+ * takes about as long as the slowest job.
+ */
+void JobsList::killAllJobs(std::ostream& out, int signum, long long grace_ns)
 {
-    int status;
-    std::list<int> erase_list;
-    SmallShell& smash = SmallShell::getInstance();
-    for(auto& pair : jobs)
+    long long start = monotonicNs();
+    updateAllJobs();
+    out << "smash: sending " << ((signum == SIGKILL)? "SIGKILL" : "SIGTERM") << " signal to " << jobs_count << " jobs:" << '\n';
+    std::vector<pid_t> pids;
+    std::vector<int> pidfds;
+    for(auto& jcb : slots)
     {
-        std::shared_ptr<JobEntry>& jcb = pair.second;
-        status = 0;
-        if(waitpid(jcb->pid, &status, WNOHANG) != 0) // If the job is dead, remove it.
+        if(!jcb.in_use)
         {
-            erase_list.push_front(jcb->job_id);
-            if(jcb->job_id == smash.fg_job_id)
-            {
-                smash.setCurrentFg(0, 0);
-            }
+            continue;
         }
+        out << jcb.pid << ": " << *jcb.command << '\n';
+        // Every job leads its own process group, unless it could not be moved to one.
+        if(killpg(jcb.pid, signum) == -1 && signalChild(jcb.pid, jcb.pidfd, signum) == -1)
+        {
+            perror("smash error: kill failed");
+        }
+        if(jcb.state == STOPPED && signum != SIGKILL)
+        {
+            killpg(jcb.pid, SIGCONT);
+        }
+        pids.push_back(jcb.pid);
+        pidfds.push_back(jcb.pidfd);
     }
+    out.flush(); // Shown before the wait
 
-    for(auto& pair : jobs)
+    std::vector<bool> done(pids.size(), false);
+    std::size_t killed = 0;
+    if(signum != SIGKILL && (killed = waitChildrenUntil(pids, pidfds, done, monotonicNs() + grace_ns)))
     {
-        std::shared_ptr<JobEntry>& jcb = pair.second;
-        status = 0;
-        
-        if(waitpid(jcb->pid, &status, WUNTRACED | WNOHANG) > 0) // If the job is stopped, update it.
+        for(std::size_t i = 0; i < pids.size(); i++)
         {
-            if(WIFSTOPPED(status)) // If job is only stopped, update it's status.
+            if(!done[i] && killpg(pids[i], SIGKILL) == -1 && signalChild(pids[i], pidfds[i], SIGKILL) == -1)
             {
-                if(jcb->state == j_state::RUNNING)
-                {
-                    jcb->start_time = time(NULL);
-                }
-                jcb->state = j_state::STOPPED;
+                perror("smash error: kill failed");
             }
         }
     }
-
-    // Actually perform the deletion:
-    for(auto& job_id : erase_list)
-    {
-        jobs.erase(job_id);
-    }
-}
-
-void JobsList::printJobsList()
-{
-    updateAllJobs();
-    auto now = time(NULL);
-    for(auto& pair : jobs)
+    waitChildrenUntil(pids, pidfds, done, monotonicNs() + QUIT_KILL_WAIT_NS);
+    if(signum != SIGKILL)
     {
-        std::shared_ptr<JobEntry>& jcb = pair.second;
-        std::cout << "[" << jcb->job_id << "] " << jcb->command << " : " << jcb->pid << " " << difftime(now, jcb->start_time) << " secs" \
-            << ((jcb->state == j_state::STOPPED)? " (stopped)" : "") << std::endl;
+        out << "smash: " << pids.size() - killed << " jobs exited, " << killed << " killed with SIGKILL, shutdown took "
+            << (monotonicNs() - start) / 1000000 << " ms" << '\n';
     }
-}
 
-void JobsList::killAllJobs(bool print)
-{
-    updateAllJobs();
-    std::list<int> erase_list;
-    if(print)
-    {
-        std::cout << "smash: sending SIGKILL signal to " << jobs.size() << " jobs:" << std::endl;
-    }
-    for(auto& pair : jobs)
+    for(int pidfd : pidfds)
     {
-        std::cout << pair.second->pid << ": " << pair.second->command << std::endl;
-        if(kill(pair.second->pid, SIGKILL) == -1)
+        if(pidfd != -1)
         {
-            perror("smash error: kill failed");
+            close(pidfd);
         }
     }
     SmallShell::getInstance().fg_job_id = 0;
-    jobs.clear();
+    slots.resize(1);
+    pid_index.clear();
+    jobs_count = 0;
+    stopped_head = stopped_tail = 0;
 }
 
-std::shared_ptr<JobEntry> JobsList::getJobById(int jobId)
+JobEntry* JobsList::getJobById(int jobId)
 {
-    updateAllJobs();
-    if(jobs.count(jobId))
+    if(jobId > 0 && jobId < static_cast<int>(slots.size()) && slots[jobId].in_use)
     {
-        return jobs[jobId];
-        
+        return &slots[jobId];
     }
     return nullptr;
 }
 
-std::shared_ptr<JobEntry> JobsList::getJobByPid(pid_t j_pid)
+JobEntry* JobsList::getJobByPid(pid_t j_pid)
 {
-    for(auto pair : jobs)
+    auto found = pid_index.find(j_pid);
+    return (found == pid_index.end())? nullptr : &slots[found->second];
+}
+
+/**
+ * Returns the jobs matching any of ranges, in job id order, in a single scan of the slots.
+ */
+std::vector<JobEntry*> JobsList::selectJobs(const std::vector<JobRange>& ranges)
+{
+    std::vector<JobEntry*> selected;
+    for(auto& jcb : slots)
     {
-        if(pair.second->pid == j_pid)
+        if(!jcb.in_use)
+        {
+            continue;
+        }
+        for(auto& range : ranges)
         {
-            return pair.second;
+            if(jcb.job_id >= range.first_id && jcb.job_id <= range.last_id && (range.any_state || jcb.state == range.state))
+            {
+                selected.push_back(&jcb);
+                break;
+            }
         }
     }
-    return nullptr;
+    return selected;
 }
 
 bool JobsList::killJobById(int jobId, bool to_update)
 {
     if(to_update) updateAllJobs();
 
-    if(jobs.count(jobId))
+    JobEntry* jcb = getJobById(jobId);
+    if(jcb)
     {
-        std::shared_ptr<JobEntry> jcb = jobs[jobId];
-
-        if(kill(jcb->pid, SIGKILL) == -1)
+        if(signalChild(jcb->pid, jcb->pidfd, SIGKILL) == -1)
         {
             perror("smash error: kill failed");
             return false;
         }
-        else
-        {
-            jobs.erase(jcb->job_id); // Erase the job from the jobs map on success
-            SmallShell& smash = SmallShell::getInstance();
-            if(jobId == smash.fg_job_id)
-            {
-                smash.fg_job_id = 0;
-            }
-        }
+        removeJob(jobId); // Erase the job from the jobs table on success
     }
     return true;
 }
 
-std::shared_ptr<JobEntry> JobsList::getLastJob(int *lastJobId = NULL)
+JobEntry* JobsList::getLastJob(int *lastJobId)
 {
-    updateAllJobs();
-    auto last = jobs.rbegin();
-    if(last==jobs.rend())
+    if(slots.size() == 1)
     {
         return nullptr;
     }
     if(lastJobId)
     {
-        *lastJobId = last->first;
+        *lastJobId = slots.back().job_id;
     }
-    return last->second;
+    return &slots.back();
 }
 
-std::shared_ptr<JobEntry> JobsList::getLastStoppedJob(int *jobId)
+JobEntry* JobsList::getLastStoppedJob(int *jobId)
 {
-    updateAllJobs();
-    auto last = jobs.rbegin();
-    if(last == jobs.rend())
-    {
-        return nullptr;
-    }
-    while(last != jobs.rend() && last->second->state != j_state::STOPPED) last++;
-    if(last == jobs.rend())
+    if(!stopped_tail)
     {
         return nullptr;
     }
     if(jobId)
     {
-        *jobId = last->first;
+        *jobId = stopped_tail;
     }
-    return last->second;
-
+    return &slots[stopped_tail];
 }
 
 bool JobsList::isEmpty() const
 {
-    return jobs.empty();
-}
\ No newline at end of file
+    return jobs_count == 0;
+}
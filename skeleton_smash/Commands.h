@@ -3,43 +3,63 @@
 
 #include <memory>
 #include <queue>
-#include <set>
 #include <time.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <map>
 #include <list>
+#include <deque>
+#include <vector>
+#include "Parser.h"
+#include "OutputSink.h"
+#include <unordered_map>
+#include <unordered_set>
 
-#define COMMAND_ARGS_MAX_LENGTH (200)
-#define COMMAND_MAX_ARGS (20)
 
-void _removeBackgroundSign(char *cmd_line);
-bool _isBackgroundCommand(const char *cmd_line);
-void arrayFree(char **arr, int len);
 bool isNumber(const std::string& str, bool is_unsigned = false);
 bool extractIntFlag(const std::string& str, int* flag_num);
+bool extractDuration(const std::string& str, long long* duration_ns);
+bool _isComplexCommand(const std::string& cmd_line);
+void printUsage(std::ostream& out, const struct rusage& usage);
+std::string describeStatus(int status);
 
-enum class CMD_Type
-{
-    Normal, Background, Pipe, ErrPipe,
-    OutRed, OutAppend
-};
+#define FINISHED_JOBS_MAX (100)
+#define QUIT_TERM_GRACE_NS (5 * 1000000000LL)  // How long "quit term" lets the jobs exit before killing them
+#define QUIT_KILL_WAIT_NS (1000000000LL)       // How long smash waits for SIGKILLed jobs to be reaped
+#define COMMAND_ARENA_SIZE (16 * 1024)
+
+// Command lines are interned: the commands, jobs and alarms made from equal texts share one refcounted copy.
+typedef std::shared_ptr<const std::string> CmdText;
+CmdText internCmdText(const std::string& text);
 
 class Command
 {
 protected:
-    std::string cmd_text;
+    CmdText cmd_text;
     pid_t pid = 0;
     bool is_background = false;
     bool valid_job = true;
     bool to_wait = true;
+    int out_fd = -1;                    // Redirection target of the command's stdout, -1 for smash's own stdout
+    std::unique_ptr<OutputSink> sink;   // Wraps out_fd once a builtin writes to it
+
+    std::ostream& out(); // Where the command prints its output
 
 public:
-    Command(const char* cmd_line, bool is_background, int pid = 0, bool valid_job = true, bool to_wait = true) : 
-    cmd_text(cmd_line), pid(pid), is_background(is_background), valid_job(valid_job), to_wait(to_wait) { }
+    Command(const CommandLine& cmd_line, bool is_background, int pid = 0, bool valid_job = true, bool to_wait = true) : 
+    cmd_text(internCmdText(cmd_line.getText())), pid(pid), is_background(is_background), valid_job(valid_job), to_wait(to_wait) { }
     virtual ~Command() = default;
+    // Commands only live while their line runs, so they are allocated from a per-line arena.
+    static void* operator new(std::size_t size);
+    static void operator delete(void* ptr, std::size_t size);
     virtual void execute() = 0;
     virtual const std::string& getCmdLine() const;
+    const CmdText& getCmdText() const;
     virtual int getPid() const;
     virtual bool isBackground() const;
+    // Sends the command's stdout to fd (owned by the caller, which closes it after execute()), or back to smash's with -1.
+    // Builtins write to it through out(), external commands get it as their stdout in the child.
+    virtual void setOutput(int fd);
     //virtual void prepare();
     //virtual void cleanup();
 };
@@ -47,7 +67,7 @@ public:
 class BuiltInCommand : public Command
 {
 public:
-    BuiltInCommand(const char* cmd_line) : Command(cmd_line, false) { }
+    BuiltInCommand(const CommandLine& cmd_line) : Command(cmd_line, false) { }
     virtual ~BuiltInCommand() = default;
 };
 
@@ -55,34 +75,45 @@ class ExternalCommand : public Command // DONE: external commands handler
 {
 protected:
     bool is_background;
-    std::string stripped_cmd;
+    CommandLine exec_line;
 
 public:
-    ExternalCommand(const char* cmd_line, bool is_background, bool valid_job, bool to_wait = true);
+    ExternalCommand(const CommandLine& cmd_line, bool is_background, bool valid_job, bool to_wait = true);
     virtual ~ExternalCommand() { }
     void execute() override;
 };
 
 class TimeoutCommand : public ExternalCommand // DONE: timeout command
 {
-    int duration;
+    long long duration_ns;
     Command* command;
 
 public:
-    TimeoutCommand(const char* cmd_line, bool is_background, int duration, bool valid_job);
-    virtual ~TimeoutCommand() = default;
+    TimeoutCommand(const CommandLine& cmd_line, bool is_background, long long duration_ns, bool valid_job, bool to_wait = true);
+    virtual ~TimeoutCommand();
     void execute() override;
+    void setOutput(int fd) override;
+};
+
+struct PipeStage
+{
+    CommandLine line;
+    bool err_pipe; // The stage's stderr (instead of stdout) feeds the next stage.
 };
 
 class PipeCommand : public Command
 {
     CMD_Type type;
-    Command* left_cmd;
-    Command* right_cmd;
+    std::vector<PipeStage> stages;
+
+    bool isPlainExternal(const CommandLine& stage_line) const;
+    bool isInlineStage(const PipeStage& stage) const;
+    pid_t launchStage(const PipeStage& stage, const std::vector<std::pair<int, int>>& redirs, const std::vector<int>& pipe_fds);
+    int runInlineStage(const PipeStage& stage, int out_fd);
 
 public:
-    PipeCommand(const char *cmd_line, CMD_Type type);
-    virtual ~PipeCommand();
+    PipeCommand(const CommandLine& cmd_line, CMD_Type type);
+    virtual ~PipeCommand() = default;
     void execute() override;
 };
 
@@ -90,15 +121,10 @@ class RedirectionCommand : public Command
 {
     CMD_Type type;
     Command* left_cmd;
-    int stdout_backup;
-    int write_fd;
     std::string filename;
 
-    void prepare();
-    void cleanup();
-
 public:
-    explicit RedirectionCommand(const char *cmd_line, CMD_Type type);
+    explicit RedirectionCommand(const CommandLine& cmd_line, CMD_Type type);
     virtual ~RedirectionCommand();
     void execute() override;
 };
@@ -109,7 +135,7 @@ class ChangeDirCommand : public BuiltInCommand // DONE: cd
     std::string pathname;
     
 public:
-    ChangeDirCommand(const char *cmd_line);
+    ChangeDirCommand(const CommandLine& cmd_line);
     virtual ~ChangeDirCommand() {}
     void execute() override;
 };
@@ -117,7 +143,7 @@ public:
 class GetCurrDirCommand : public BuiltInCommand // DONE: pwd
 {
 public:
-    GetCurrDirCommand(const char *cmd_line);
+    GetCurrDirCommand(const CommandLine& cmd_line);
     virtual ~GetCurrDirCommand() {}
     void execute() override;
 }; 
@@ -126,19 +152,55 @@ class ShowPidCommand : public BuiltInCommand // DONE: showpid
 {
     pid_t pid;
 public:
-    ShowPidCommand(const char *cmd_line);
+    ShowPidCommand(const CommandLine& cmd_line);
     virtual ~ShowPidCommand() {}
     void execute() override;
 };
 
+class TimeCommand : public Command // time <command>
+{
+    Command* command;
+public:
+    TimeCommand(const CommandLine& cmd_line);
+    virtual ~TimeCommand();
+    void execute() override;
+    void setOutput(int fd) override;
+};
+
+class StatsCommand : public BuiltInCommand // stats [-v | reset]
+{
+    bool histograms = false;
+    bool reset = false;
+public:
+    StatsCommand(const CommandLine& cmd_line);
+    virtual ~StatsCommand() {}
+    void execute() override;
+};
+
+class ParallelCommand : public BuiltInCommand // parallel [-j N] (-f <file> | <template> ::: <args...>)
+{
+    unsigned int max_running;
+    std::string cmds_file;              // Read at execution, if given
+    std::vector<std::string> cmd_texts;
+
+    void reportExit(std::size_t index, int status, long long elapsed_ns);
+
+public:
+    ParallelCommand(const CommandLine& cmd_line, unsigned int max_running);
+    virtual ~ParallelCommand() {}
+    void execute() override;
+};
+
 class JobsList;
 
-class QuitCommand : public BuiltInCommand // DONE: quit
+class QuitCommand : public BuiltInCommand // quit [kill | term [<secs>]]
 {
     bool is_kill=false;
+    bool is_term=false;
+    long long grace_ns = QUIT_TERM_GRACE_NS;
     std::shared_ptr<JobsList> jobs;
 public:
-    QuitCommand(const char *cmd_line, std::shared_ptr<JobsList> jobs);
+    QuitCommand(const CommandLine& cmd_line, std::shared_ptr<JobsList> jobs);
     virtual ~QuitCommand() {}
     void execute() override;
 };
@@ -150,33 +212,84 @@ enum j_state
 	RUNNING, STOPPED, ZOMBIE
 };
 
+// Jobs named on a command line: an id, a range of ids, or every job in some state (kill's "3", "%1-500", "@stopped").
+struct JobRange
+{
+    int first_id;
+    int last_id;        // Inclusive
+    bool any_state;
+    j_state state;      // Only the jobs in this state, unless any_state
+};
+
 struct JobEntry
 {
     int job_id;
     int pid;
-    std::string command;
+    CmdText command;
     time_t start_time;
     j_state state;
     bool is_background;
+    int status;             // Last wait status (stopped / exited / killed)
+    struct rusage usage;    // Filled by wait4 once the job finished
+    int pidfd;          // -1 if pidfds are not supported
+    bool in_use;        // The slot holds a live job
+    int prev_stopped;   // Neighbours in the stopped jobs list (job ids, 0 = none)
+    int next_stopped;
 };
 
+// The last change of a child someone waits for by pid, in case another path (updateAllJobs) reaped it first.
+struct WatchedChild
+{
+    bool changed;           // status holds an exit or a stop not yet taken
+    int status;
+    struct rusage usage;
+};
+
+// Jobs live in slots indexed by their job id, so a job id is a stable handle and every lookup is O(1).
+// Free slots at the end are dropped, which keeps "max job id + 1" the next id.
+// The stopped jobs are also chained through their slots in ascending job id order.
 class JobsList
 {
-    std::map<int, std::shared_ptr<JobEntry>> jobs;
+    std::deque<JobEntry> slots;                 // slots[0] is never used
+    std::unordered_map<pid_t, int> pid_index;   // pid -> job id
+    std::size_t jobs_count = 0;
+    std::deque<JobEntry> finished;              // Jobs that finished since the last "jobs -l" (at most FINISHED_JOBS_MAX)
+    int last_status = 0;                        // Wait status of the last foreground command
+    struct rusage last_usage = {};              // Its rusage (summed over the stages of a pipeline)
+    int stopped_head = 0;
+    int stopped_tail = 0;                       // The stopped job with the highest id
+    std::unordered_map<pid_t, WatchedChild> watched;
+    static volatile sig_atomic_t children_changed;
+
+    void linkStopped(int job_id);
+    void unlinkStopped(int job_id);
 
 public:
-    JobsList() = default;
+    JobsList();
     ~JobsList() = default;
-    std::shared_ptr<JobEntry> addJob(Command *cmd, bool isStopped = false);
+    JobEntry* addJob(Command *cmd, bool isStopped = false);
     void removeJob(int job_id);
+    void setJobState(JobEntry* jcb, j_state state);
     void updateAllJobs();
-    void printJobsList();
-    void killAllJobs(bool print=true);
-    std::shared_ptr<JobEntry> getJobById(int jobId);
-    std::shared_ptr<JobEntry> getJobByPid(pid_t j_pid);
+    int waitForeground(pid_t j_pid);
+    static void notifyChildChanged();
+    void applyChildStatus(pid_t j_pid, int status, const struct rusage* usage = NULL);
+    void watchChild(pid_t pid);
+    void unwatchChild(pid_t pid);
+    bool takeWatchedStatus(pid_t pid, int* status, struct rusage* usage);
+    void recordForeground(int status, const struct rusage& usage);
+    void resetLastUsage();
+    int getLastStatus() const;
+    const struct rusage& getLastUsage() const;
+    void printFinishedJobs(std::ostream& out);
+    void printJobsList(std::ostream& out);
+    void killAllJobs(std::ostream& out, int signum = SIGKILL, long long grace_ns = 0);
+    JobEntry* getJobById(int jobId);
+    JobEntry* getJobByPid(pid_t j_pid);
+    std::vector<JobEntry*> selectJobs(const std::vector<JobRange>& ranges);
     bool killJobById(int jobId, bool to_update = true);
-    std::shared_ptr<JobEntry> getLastJob(int *lastJobId);
-    std::shared_ptr<JobEntry> getLastStoppedJob(int *jobId = NULL);
+    JobEntry* getLastJob(int *lastJobId = NULL);
+    JobEntry* getLastStoppedJob(int *jobId = NULL);
     bool isEmpty() const;
 };
 //***********************************************************//
@@ -185,7 +298,7 @@ class ChpromptCommand : public BuiltInCommand // DONE: chprompt
 {
     std::string new_prompt;
 public:
-    ChpromptCommand(const char *cmd_line);
+    ChpromptCommand(const CommandLine& cmd_line);
     virtual ~ChpromptCommand() {}
     void execute() override;
 };
@@ -193,21 +306,24 @@ public:
 class JobsCommand : public BuiltInCommand // DONE: jobs
 {
     std::shared_ptr<JobsList> jobs;
+    bool long_format = false; // jobs -l: also report the jobs that finished, with their exit status and rusage
 
 public:
-    JobsCommand(const char *cmd_line, std::shared_ptr<JobsList> jobs);
+    JobsCommand(const CommandLine& cmd_line, std::shared_ptr<JobsList> jobs);
     virtual ~JobsCommand() {}
     void execute() override;
 };
 
-class KillCommand : public BuiltInCommand // DONE: kill
+class KillCommand : public BuiltInCommand // kill -<signal> [-g] <jobs>...
 {
     int signum;
-    int job_id;
+    bool by_group;                  // Signal each job's whole process group
+    std::vector<JobRange> targets;
     std::shared_ptr<JobsList> jobs;
 
 public:
-    KillCommand(const char *cmd_line, int signum, int job_id, std::shared_ptr<JobsList> jobs);
+    KillCommand(const CommandLine& cmd_line, int signum, bool by_group, const std::vector<JobRange>& targets,
+        std::shared_ptr<JobsList> jobs);
     virtual ~KillCommand() { }
     void execute() override;
 };
@@ -217,7 +333,7 @@ class ForegroundCommand : public BuiltInCommand
     // DONE: fg
     int job_id_to_fg=0;
 public:
-    ForegroundCommand(const char *cmd_line);
+    ForegroundCommand(const CommandLine& cmd_line);
     virtual ~ForegroundCommand() {}
     void execute() override;
 };
@@ -227,17 +343,38 @@ class BackgroundCommand : public BuiltInCommand
     // DONE: bg
     int job_id_to_bg=0;
 public:
-    BackgroundCommand(const char *cmd_line);
+    BackgroundCommand(const CommandLine& cmd_line);
     virtual ~BackgroundCommand() {}
     void execute() override;
 };
 
+enum class CopyMethod
+{
+    CopyFileRange, Splice, SendFile, ReadWrite
+};
+
+#define CAT_READAHEAD_FILES (16)          // Files cat keeps open ahead of the one it copies
+#define CAT_READAHEAD_BYTES (1024 * 1024)  // Readahead requested for each of them
+
+struct OpenedFile
+{
+    int fd;     // -1 if the open failed
+    int error;  // errno of the failed open
+};
+
 class CatCommand : public BuiltInCommand // DONE: cat
 {
     std::queue<std::string> f_queue;
+    std::deque<OpenedFile> ahead;   // The next files, opened and being read ahead, in output order
+
+    void openAhead();
+    void closeAhead();
+    static CopyMethod pickCopyMethod(int out_fd);
+    static bool copyZeroCopy(int in_fd, int out_fd, CopyMethod method, unsigned long long& copied);
+    static void copyReadWrite(int in_fd, int out_fd, unsigned long long& copied);
 public:
-    CatCommand(const char *cmd_line);
-    virtual ~CatCommand() { }
+    CatCommand(const CommandLine& cmd_line);
+    virtual ~CatCommand();
     void execute() override;
 };
 
@@ -245,42 +382,51 @@ public:
 
 struct AlarmEntry
 {
-    time_t finish_time;
+    long long finish_time; // CLOCK_MONOTONIC, in nanoseconds
     pid_t pid;
-    std::string cmd_text;
+    int pidfd;             // Owned by the entry, -1 if pidfds are not supported
+    CmdText cmd_text;
+};
 
-    bool operator<(const AlarmEntry& other) const
-    {
-        return (this->finish_time - other.finish_time) < 0;
-    }
+class AlarmList
+{
+    // Ordered by deadline, with a pid index so an alarm can be cancelled once its process is gone.
+    std::multimap<long long, AlarmEntry> alarms;
+    std::unordered_map<pid_t, std::multimap<long long, AlarmEntry>::iterator> pid_index;
+    timer_t timer;
+    bool timer_created = false;
 
-    bool operator==(const AlarmEntry& other) const
-    {
-        return (this->finish_time == other.finish_time);
-    }
+public:
+    AlarmList() = default;
+    ~AlarmList();
+    void addAlarm(pid_t pid, const CmdText& cmd_text, long long duration_ns);
+    void cancelAlarm(pid_t pid);
+    bool popExpired(AlarmEntry* entry);
+    void rearm();
+    void forgetInherited();
+    bool isEmpty() const;
+};
 
-    bool operator<=(const AlarmEntry& other) const
-    {
-        return *this < other || *this == other;
-    }
+//*****************PATH CACHE*****************//
 
-    bool operator>(const AlarmEntry& other) const
-    {
-        return !(*this <= other);
-    }
+class PathCache
+{
+    std::string path_env;
+    std::unordered_map<std::string, std::string> cache;
 
-    bool operator>=(const AlarmEntry& other) const
-    {
-        return *this > other || *this == other;
-    }
+    void refresh();
 
-    bool operator!=(const AlarmEntry& other) const
-    {
-        return !(*this == other);
-    }
+public:
+    PathCache() = default;
+    ~PathCache() = default;
+    bool resolve(const std::string& prog_name, std::string& full_path);
+    void invalidate();
 };
 
 //*****************SMASH CLASS*****************//
+// Creates a builtin command from its (already parsed) line, throwing a CmdError if its arguments are invalid.
+typedef Command* (*BuiltinFactory)(const CommandLine& cmd_line);
+
 class SmallShell
 {
 private:
@@ -289,15 +435,16 @@ private:
     bool quit_flag = false;
     std::string last_pwd;
     std::shared_ptr<JobsList> jobs;
-    std::shared_ptr<std::list<AlarmEntry>> alarm_list;
+    std::shared_ptr<AlarmList> alarm_list;
     int fg_job_id;
     pid_t fg_pid;
+    const std::vector<pid_t>* fg_batch = nullptr; // Children a foreground builtin (parallel) runs at once, if any
+    PathCache path_cache;
 
-    const std::set<std::string> builtin_set;
+    std::unordered_map<std::string, BuiltinFactory> builtins; // Builtin name -> factory, one hash lookup per line
+    std::unordered_set<std::string> inline_builtins;          // Builtins a pipeline may run inside smash
     
-    SmallShell() : main_pid(getpid()), prompt("smash"), quit_flag(false), last_pwd(""), jobs(std::make_shared<JobsList>(JobsList())),
-    alarm_list(std::make_shared<std::list<AlarmEntry>>(std::list<AlarmEntry>())), fg_job_id(0),
-    builtin_set({"chprompt", "showpid", "pwd", "cd", "jobs", "kill", "fg", "bg", "quit", "cat"}) {}
+    SmallShell();
     
     void setLastPwd(const std::string& new_pwd);
 
@@ -307,7 +454,7 @@ private:
     friend void ctrlZHandler();
 
 public:
-    Command *CreateCommand(const char *cmd_line, bool valid_job = true, bool to_wait = true);
+    Command *CreateCommand(const CommandLine& cmd_line, bool valid_job = true, bool to_wait = true);
     SmallShell(SmallShell const &) = delete;     // disable copy ctor
     void operator=(SmallShell const &) = delete; // disable = operator
     static SmallShell &getInstance()             // make SmallShell singleton
@@ -317,14 +464,17 @@ public:
         return instance;
     }
     ~SmallShell();
-    void executeCommand(const char *cmd_line);
+    void executeCommand(const char *cmd_text);
 
     std::shared_ptr<JobsList> getJobsList();
-    std::shared_ptr<std::list<AlarmEntry>> getAlarmList();
+    std::shared_ptr<AlarmList> getAlarmList();
+    PathCache& getPathCache();
     const std::string& getPrompt() const; // get the prompt
     pid_t getPid() const; // get the main instance's pid
     void setPrompt(const std::string& new_prompt); // set the prompt to new_prompt
-    bool isBuiltIn(const char* cmd_line) const;
+    bool isBuiltIn(const std::string& cmd_name) const;
+    bool isInlineBuiltIn(const std::string& cmd_name) const;
+    void registerBuiltin(const std::string& name, BuiltinFactory factory, bool inline_stage = false);
     bool getQuitFlag() const;
 
     bool isPwdSet() const;
@@ -332,6 +482,8 @@ public:
     int getCurrentFgJobId() const;
     pid_t getCurrentFgPid() const;
     void setCurrentFg(int job_id, pid_t j_pid);
+    const std::vector<pid_t>* getCurrentFgBatch() const;
+    void setCurrentFgBatch(const std::vector<pid_t>* pids);
 };
 
 #endif //SMASH_COMMAND_H_
@@ -0,0 +1,375 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include "EventLoop.h"
+#include "signals.h"
+#include "Commands.h"
+#include "Exceptions.h"
+#include "Stats.h"
+#include "Clock.h"
+
+#define SIGNAL_READ_BATCH (64)
+#define UNTIL_POLL_MAX_MS (1000) // Longest single poll of waitChildrenUntil (keeps the timeout in an int)
+#define UNTIL_POLL_BLIND_MS (10) // Without the signal pipe, a child with no pidfd is only noticed by polling.
+
+enum pipe_side { PIPE_R = 0, PIPE_W };
+
+static int signal_pipe[2] = {-1, -1};
+static int epoll_fd = -1;
+static bool input_pollable = false; // Regular files cannot be added to epoll: they are always ready.
+static pid_t owner_pid = 0;         // A forked child must not consume the signals meant for smash.
+
+void initEventLoop(int input_fd)
+{
+    if(pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        throw SyscallError("pipe2");
+    }
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        throw SyscallError("epoll_create1");
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = signal_pipe[PIPE_R];
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_pipe[PIPE_R], &ev) == -1)
+    {
+        throw SyscallError("epoll_ctl");
+    }
+    if(input_fd != -1)
+    {
+        ev.data.fd = input_fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &ev) == 0)
+        {
+            input_pollable = true;
+        }
+        else if(errno != EPERM)
+        {
+            throw SyscallError("epoll_ctl");
+        }
+    }
+    owner_pid = getpid();
+}
+
+void initChildEventLoop()
+{
+    if(signal_pipe[PIPE_R] == -1)
+    {
+        return;
+    }
+    int inherited[2] = {signal_pipe[PIPE_R], signal_pipe[PIPE_W]};
+    signal_pipe[PIPE_R] = signal_pipe[PIPE_W] = -1; // A signal arriving meanwhile is dropped, not written to smash.
+    close(inherited[PIPE_R]);
+    close(inherited[PIPE_W]);
+    close(epoll_fd);
+    epoll_fd = -1;
+    input_pollable = false;
+    SmallShell::getInstance().getAlarmList()->forgetInherited();
+    initEventLoop(-1);
+}
+
+void signalNotifier(int sig_num)
+{
+    int backup_errno = errno;
+    unsigned char sig = sig_num;
+    if(signal_pipe[PIPE_W] != -1)
+    {
+        // Never blocks: if the pipe is full, it is already readable and the loop will wake up anyway.
+        ssize_t res = write(signal_pipe[PIPE_W], &sig, 1);
+        (void)res;
+    }
+    errno = backup_errno;
+}
+
+void dispatchSignals(bool reap_children)
+{
+    if(signal_pipe[PIPE_R] == -1 || getpid() != owner_pid)
+    {
+        return;
+    }
+    unsigned char sigs[SIGNAL_READ_BATCH];
+    ssize_t count;
+    while((count = read(signal_pipe[PIPE_R], sigs, sizeof(sigs))) > 0)
+    {
+        for(ssize_t i = 0; i < count; i++)
+        {
+            STATS_SCOPE(StatPhase::Signal);
+            switch(sigs[i])
+            {
+                case SIGTSTP:
+                    ctrlZHandler();
+                    break;
+                case SIGINT:
+                    ctrlCHandler();
+                    break;
+                case SIGALRM:
+                    alarmHandler();
+                    break;
+                case SIGCHLD:
+                    JobsList::notifyChildChanged();
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if(reap_children)
+    {
+        SmallShell::getInstance().getJobsList()->updateAllJobs();
+    }
+}
+
+void waitForInput()
+{
+    if(epoll_fd == -1)
+    {
+        return;
+    }
+    dispatchSignals(true);
+    if(!input_pollable)
+    {
+        return;
+    }
+    struct epoll_event events[2];
+    for(;;)
+    {
+        int count = epoll_wait(epoll_fd, events, 2, -1);
+        if(count == -1)
+        {
+            if(errno == EINTR) // A handler ran: its signal is waiting in the pipe.
+            {
+                continue;
+            }
+            throw SyscallError("epoll_wait");
+        }
+        bool input_ready = false;
+        for(int i = 0; i < count; i++)
+        {
+            if(events[i].data.fd == signal_pipe[PIPE_R])
+            {
+                dispatchSignals(true);
+            }
+            else
+            {
+                input_ready = true;
+            }
+        }
+        if(input_ready)
+        {
+            return;
+        }
+    }
+}
+
+pid_t waitChild(pid_t pid, int pidfd, int* status, int options, struct rusage* usage)
+{
+    STATS_SCOPE(StatPhase::Wait);
+    if(signal_pipe[PIPE_R] == -1 || getpid() != owner_pid)
+    {
+        return wait4(pid, status, options, usage);
+    }
+    struct pollfd pfds[2] = {{signal_pipe[PIPE_R], POLLIN, 0}, {pidfd, POLLIN, 0}};
+    for(;;)
+    {
+        // A SIGCHLD arriving between this check and poll() is already in the pipe, so it cannot be missed.
+        pid_t res = wait4(pid, status, options | WNOHANG, usage);
+        if(res != 0 || (options & WNOHANG))
+        {
+            return res;
+        }
+        if(poll(pfds, (pidfd == -1)? 1 : 2, -1) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        dispatchSignals(false); // Reaping every child here could steal pid's status.
+    }
+}
+
+int waitAnyChild(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, int* status, struct rusage* usage,
+    int options)
+{
+    STATS_SCOPE(StatPhase::Wait);
+    bool owner = (signal_pipe[PIPE_R] != -1 && getpid() == owner_pid);
+    std::vector<struct pollfd> pfds;
+    for(;;)
+    {
+        if(owner)
+        {
+            pfds.assign(1, {signal_pipe[PIPE_R], POLLIN, 0});
+        }
+        for(std::size_t i = 0; i < pids.size(); i++)
+        {
+            pid_t res = wait4(pids[i], status, options | WNOHANG, usage);
+            if(res > 0)
+            {
+                return i;
+            }
+            // An inline line of the waiter (jobs, kill, a pipeline...) may have reaped it through updateAllJobs.
+            if((res == 0 || errno == ECHILD) && SmallShell::getInstance().getJobsList()->takeWatchedStatus(pids[i], status, usage))
+            {
+                return i;
+            }
+            if(res == -1)
+            {
+                return -1;
+            }
+            if(pidfds[i] != -1)
+            {
+                pfds.push_back({pidfds[i], POLLIN, 0});
+            }
+        }
+        if(pids.empty())
+        {
+            return -1;
+        }
+        if(!owner) // No signal pipe to wake us up on SIGCHLD.
+        {
+            return (wait4(pids[0], status, options, usage) == -1)? -1 : 0;
+        }
+        if(poll(pfds.data(), pfds.size(), -1) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        dispatchSignals(false);
+    }
+}
+
+/**
+ * Adds the rusage of one child to a total: times and counters are summed, the max RSS is the largest one.
+ */
+static void addUsage(struct rusage* total, const struct rusage& usage)
+{
+    timeradd(&total->ru_utime, &usage.ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage.ru_stime, &total->ru_stime);
+    if(usage.ru_maxrss > total->ru_maxrss)
+    {
+        total->ru_maxrss = usage.ru_maxrss;
+    }
+    total->ru_nvcsw += usage.ru_nvcsw;
+    total->ru_nivcsw += usage.ru_nivcsw;
+}
+
+bool waitChildren(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, int options,
+    int* last_status, struct rusage* total_usage)
+{
+    STATS_SCOPE(StatPhase::Wait);
+    bool success = true;
+    int status = 0;
+    struct rusage usage;
+    if(signal_pipe[PIPE_R] == -1 || getpid() != owner_pid)
+    {
+        for(std::size_t i = 0; i < pids.size(); i++)
+        {
+            memset(&usage, 0, sizeof(usage));
+            bool waited = (wait4(pids[i], &status, options, &usage) != -1);
+            success &= waited;
+            if(waited && last_status && i + 1 == pids.size())
+            {
+                *last_status = status;
+            }
+            if(waited && total_usage)
+            {
+                addUsage(total_usage, usage);
+            }
+        }
+        return success;
+    }
+    std::vector<bool> done(pids.size(), false);
+    std::size_t remaining = pids.size();
+    std::vector<struct pollfd> pfds;
+    for(;;)
+    {
+        pfds.assign(1, {signal_pipe[PIPE_R], POLLIN, 0});
+        for(std::size_t i = 0; i < pids.size(); i++)
+        {
+            if(done[i])
+            {
+                continue;
+            }
+            memset(&usage, 0, sizeof(usage));
+            pid_t res = wait4(pids[i], &status, options | WNOHANG, &usage);
+            if(res != 0)
+            {
+                success &= (res != -1);
+                done[i] = true;
+                remaining--;
+                if(res != -1 && last_status && i + 1 == pids.size())
+                {
+                    *last_status = status;
+                }
+                if(res != -1 && total_usage)
+                {
+                    addUsage(total_usage, usage);
+                }
+            }
+            else if(pidfds[i] != -1)
+            {
+                pfds.push_back({pidfds[i], POLLIN, 0});
+            }
+        }
+        if(!remaining)
+        {
+            return success;
+        }
+        if(poll(pfds.data(), pfds.size(), -1) == -1 && errno != EINTR)
+        {
+            return false;
+        }
+        dispatchSignals(false);
+    }
+}
+
+std::size_t waitChildrenUntil(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, std::vector<bool>& done,
+    long long deadline_ns)
+{
+    STATS_SCOPE(StatPhase::Wait);
+    bool owner = (signal_pipe[PIPE_R] != -1 && getpid() == owner_pid);
+    std::vector<struct pollfd> pfds;
+    for(;;)
+    {
+        pfds.clear();
+        if(owner)
+        {
+            pfds.push_back({signal_pipe[PIPE_R], POLLIN, 0});
+        }
+        std::size_t remaining = 0;
+        for(std::size_t i = 0; i < pids.size(); i++)
+        {
+            int status;
+            if(done[i] || wait4(pids[i], &status, WNOHANG, NULL) != 0)
+            {
+                done[i] = true;
+                continue;
+            }
+            remaining++;
+            if(pidfds[i] != -1)
+            {
+                pfds.push_back({pidfds[i], POLLIN, 0});
+            }
+        }
+        long long left_ns = deadline_ns - monotonicNs();
+        if(!remaining || left_ns <= 0)
+        {
+            return remaining;
+        }
+        int timeout_ms = (left_ns / 1000000 < UNTIL_POLL_MAX_MS)? left_ns / 1000000 + 1 : UNTIL_POLL_MAX_MS;
+        if(!owner && timeout_ms > UNTIL_POLL_BLIND_MS)
+        {
+            timeout_ms = UNTIL_POLL_BLIND_MS;
+        }
+        if(poll(pfds.data(), pfds.size(), timeout_ms) == -1 && errno != EINTR)
+        {
+            return remaining;
+        }
+        if(owner)
+        {
+            dispatchSignals(false);
+        }
+    }
+}
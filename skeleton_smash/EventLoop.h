@@ -0,0 +1,49 @@
+#ifndef SMASH_EVENT_LOOP_H_
+#define SMASH_EVENT_LOOP_H_
+
+#include <vector>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// Signals are not handled inside their handlers: signalNotifier() only writes the signal number to a self-pipe.
+// The real handling (printing, touching the jobs list, waitpid) runs in the main flow whenever smash waits for
+// something: the next input line (epoll over the input and the pipe) or a child (poll over the pipe).
+
+void initEventLoop(int input_fd); // input_fd is the fd commands are read from, -1 if there is none
+
+// In a forked smash child that runs a command itself (a pipeline stage): replaces the signal pipe shared with smash
+// by the child's own, and drops the alarms and timer inherited from smash. The child then handles its own signals.
+void initChildEventLoop();
+void signalNotifier(int sig_num); // The handler installed for every signal smash catches. Async-signal-safe.
+
+// Runs the handling of every signal received so far, without blocking.
+// With reap_children, finished children are also reaped right away (never while a specific child is awaited).
+void dispatchSignals(bool reap_children);
+
+// Dispatches signals until the input fd is readable (or has hung up).
+void waitForInput();
+
+// wait4() for a single child which keeps dispatching signals (ctrl-C, ctrl-Z, alarms) while it blocks.
+// If pidfd is not -1, the child's exit wakes the wait directly instead of through SIGCHLD.
+pid_t waitChild(pid_t pid, int pidfd, int* status, int options, struct rusage* usage = NULL);
+
+// Waits until one of pids exits (or stops, with WUNTRACED in options) and reaps it (pidfds[i] is the pidfd of pids[i],
+// or -1), dispatching signals meanwhile. A child watched by the jobs list (JobsList::watchChild) that was reaped by
+// someone else meanwhile counts too, with the status it was reaped with.
+// Returns the index of that child in pids with its status in *status (and rusage in *usage), or -1 if waiting failed.
+int waitAnyChild(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, int* status, struct rusage* usage = NULL,
+    int options = 0);
+
+// Waits for all of pids at once (pidfds[i] is the pidfd of pids[i], or -1), dispatching signals meanwhile.
+// The status of the last child goes to *last_status and the rusage of all of them is added to *total_usage.
+// Returns false if waiting for one of them failed.
+bool waitChildren(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, int options,
+    int* last_status = NULL, struct rusage* total_usage = NULL);
+
+// Waits for all of pids together, like waitChildren, but only until deadline_ns (on the monotonic clock).
+// done[i] is set for every child reaped (or not waitable anymore), children already marked done are skipped.
+// Returns the number of children still running at the deadline.
+std::size_t waitChildrenUntil(const std::vector<pid_t>& pids, const std::vector<int>& pidfds, std::vector<bool>& done,
+    long long deadline_ns);
+
+#endif //SMASH_EVENT_LOOP_H_
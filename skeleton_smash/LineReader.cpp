@@ -0,0 +1,69 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "LineReader.h"
+#include "Exceptions.h"
+
+LineReader::LineReader(int fd) : fd(fd), block(LINE_READER_BLOCK_SIZE) { }
+
+LineReader::LineReader(const std::string& text) : fd(-1), block(text.begin(), text.end()), len(text.size()), eof(true) { }
+
+/**
+ * Reads the next block of input. Returns false if there is nothing more to read.
+ */
+bool LineReader::fill()
+{
+    if(eof)
+    {
+        return false;
+    }
+    ssize_t res;
+    do
+    {
+        res = read(fd, block.data(), block.size());
+    } while(res == -1 && errno == EINTR);
+    if(res == -1)
+    {
+        eof = true;
+        throw SyscallError("read");
+    }
+    if(res == 0)
+    {
+        eof = true;
+        return false;
+    }
+    pos = 0;
+    len = res;
+    return true;
+}
+
+bool LineReader::nextLine(std::string& line)
+{
+    line.clear();
+    bool got_data = false;
+    while(pos < len || fill())
+    {
+        got_data = true;
+        const char* start = block.data() + pos;
+        const char* newline = static_cast<const char*>(memchr(start, '\n', len - pos));
+        if(newline)
+        {
+            line.append(start, newline - start);
+            pos += newline - start + 1;
+            return true;
+        }
+        line.append(start, len - pos); // The line continues in the next block.
+        pos = len;
+    }
+    return got_data;
+}
+
+bool LineReader::hasBuffered() const
+{
+    return pos < len || fd == -1;
+}
+
+int LineReader::getFd() const
+{
+    return fd;
+}
@@ -0,0 +1,35 @@
+#ifndef SMASH_LINE_READER_H_
+#define SMASH_LINE_READER_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#define LINE_READER_BLOCK_SIZE (64 * 1024)
+
+// Splits an input source into lines.
+// A file descriptor is read with read(2) in large blocks (a tty still returns one line per read),
+// a string (smash -c) is split in place. Neither is tied to std::cout, so the caller decides when to flush.
+class LineReader
+{
+    int fd;                     // -1 when reading from a string
+    std::vector<char> block;
+    std::size_t pos = 0;        // Next unread byte in block
+    std::size_t len = 0;        // Bytes of valid data in block
+    bool eof = false;
+
+    bool fill();
+
+public:
+    explicit LineReader(int fd);
+    explicit LineReader(const std::string& text);
+    ~LineReader() = default;
+
+    // Stores the next line (without its '\n') in line. Returns false on end of input.
+    // A last line with no trailing newline is still returned. Throws SyscallError if read fails.
+    bool nextLine(std::string& line);
+    bool hasBuffered() const; // True if nextLine() will not need to read more input
+    int getFd() const;        // -1 when reading from a string
+};
+
+#endif //SMASH_LINE_READER_H_
@@ -0,0 +1,101 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "OutputSink.h"
+
+FdOutBuf::FdOutBuf(int fd) : fd(fd)
+{
+    setp(buffer, buffer + sizeof(buffer));
+}
+
+FdOutBuf::~FdOutBuf()
+{
+    flushBuffer();
+}
+
+/**
+ * Writes out the whole buffer, retrying short writes. Returns false (dropping the data) if write fails.
+ */
+bool FdOutBuf::flushBuffer()
+{
+    const char* data = pbase();
+    std::size_t left = pptr() - pbase();
+    setp(buffer, buffer + sizeof(buffer));
+    while(left)
+    {
+        ssize_t res = write(fd, data, left);
+        if(res == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        left -= res;
+    }
+    return true;
+}
+
+FdOutBuf::int_type FdOutBuf::overflow(int_type ch)
+{
+    if(!flushBuffer())
+    {
+        return traits_type::eof();
+    }
+    if(!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+/**
+ * Small writes are buffered, anything at least a buffer long goes straight to the fd.
+ */
+std::streamsize FdOutBuf::xsputn(const char* s, std::streamsize count)
+{
+    if(count < epptr() - pptr())
+    {
+        memcpy(pptr(), s, count);
+        pbump(count);
+        return count;
+    }
+    if(!flushBuffer())
+    {
+        return 0;
+    }
+    if(count < epptr() - pptr())
+    {
+        memcpy(pptr(), s, count);
+        pbump(count);
+        return count;
+    }
+    std::streamsize done = 0;
+    while(done < count)
+    {
+        ssize_t res = write(fd, s + done, count - done);
+        if(res == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+int FdOutBuf::sync()
+{
+    return flushBuffer()? 0 : -1;
+}
+
+OutputSink::OutputSink(int fd) : std::ostream(NULL), buf(fd)
+{
+    rdbuf(&buf);
+}
@@ -0,0 +1,38 @@
+#ifndef SMASH_OUTPUT_SINK_H_
+#define SMASH_OUTPUT_SINK_H_
+
+#include <ostream>
+#include <streambuf>
+
+#define OUTPUT_SINK_BUFFER_SIZE (4096)
+
+// A streambuf that writes to a file descriptor it does not own, buffered and flushed with write(2).
+class FdOutBuf : public std::streambuf
+{
+    int fd;
+    char buffer[OUTPUT_SINK_BUFFER_SIZE];
+
+    bool flushBuffer();
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize count) override;
+    int sync() override;
+
+public:
+    explicit FdOutBuf(int fd);
+    ~FdOutBuf();
+};
+
+// Where a redirected builtin writes instead of std::cout: the redirection target is never dup2'ed over smash's stdout.
+// Whatever is left in the buffer is written when the sink is flushed or destroyed.
+class OutputSink : public std::ostream
+{
+    FdOutBuf buf;
+
+public:
+    explicit OutputSink(int fd);
+    ~OutputSink() = default;
+};
+
+#endif //SMASH_OUTPUT_SINK_H_
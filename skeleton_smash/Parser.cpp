@@ -0,0 +1,427 @@
+#include <string.h>
+#include "Parser.h"
+
+static const char* const PARSER_WHITESPACE = " \n\r\t\f\v";
+
+static bool isWhitespace(char c)
+{
+    return c != '\0' && strchr(PARSER_WHITESPACE, c) != NULL;
+}
+
+ParsedLine::ParsedLine(const char* cmd_line) : line(cmd_line)
+{
+    tokenize();
+}
+
+ParsedLine::ParsedLine(const std::string& cmd_line) : line(cmd_line)
+{
+    tokenize();
+}
+
+void ParsedLine::pushOperator(TokenType type, std::size_t src_begin, std::size_t src_len)
+{
+    Token tok = {type, arena.size(), src_len, src_begin, src_begin + src_len};
+    arena.append(line, src_begin, src_len);
+    arena.push_back('\0');
+    tokens.push_back(tok);
+}
+
+void ParsedLine::tokenize()
+{
+    const std::size_t n = line.size();
+    // A token never takes more arena room than twice its source (e.g. "a|b": three 1-char tokens, each NUL-terminated),
+    // so reserving once guarantees the arena is never reallocated while tokenizing.
+    arena.reserve(2 * n + 1);
+    tokens.reserve(n / 2 + 1);
+
+    // The background sign is only an operator as the last non-whitespace character of the line.
+    std::size_t last = line.find_last_not_of(PARSER_WHITESPACE);
+    std::size_t bg_pos = (last != std::string::npos && line[last] == '&')? last : std::string::npos;
+
+    std::size_t i = 0;
+    while(i < n)
+    {
+        while(i < n && isWhitespace(line[i]))
+        {
+            i++;
+        }
+        if(i >= n)
+        {
+            break;
+        }
+
+        char c = line[i];
+        if(c == '|')
+        {
+            bool err_pipe = (i + 1 < n && line[i + 1] == '&' && i + 1 != bg_pos);
+            pushOperator(err_pipe? TokenType::ErrPipe : TokenType::Pipe, i, err_pipe? 2 : 1);
+            i += err_pipe? 2 : 1;
+            continue;
+        }
+        if(c == '>')
+        {
+            bool append = (i + 1 < n && line[i + 1] == '>');
+            pushOperator(append? TokenType::OutAppend : TokenType::OutRed, i, append? 2 : 1);
+            i += append? 2 : 1;
+            continue;
+        }
+        if(i == bg_pos)
+        {
+            pushOperator(TokenType::Background, i, 1);
+            i++;
+            continue;
+        }
+
+        // A word: runs until unquoted whitespace or an operator.
+        Token tok = {TokenType::Word, arena.size(), 0, i, i};
+        char quote = 0;
+        while(i < n)
+        {
+            c = line[i];
+            if(quote == '\'') // Everything is literal inside single quotes.
+            {
+                if(c == '\'') quote = 0;
+                else arena.push_back(c);
+                i++;
+                continue;
+            }
+            if(quote == '"')
+            {
+                if(c == '"')
+                {
+                    quote = 0;
+                }
+                else if(c == '\\' && i + 1 < n && strchr("\"\\$`", line[i + 1]))
+                {
+                    arena.push_back(line[++i]);
+                }
+                else
+                {
+                    arena.push_back(c);
+                }
+                i++;
+                continue;
+            }
+            if(isWhitespace(c) || c == '|' || c == '>' || i == bg_pos)
+            {
+                break;
+            }
+            if(c == '\'' || c == '"')
+            {
+                quote = c;
+            }
+            else if(c == '\\' && i + 1 < n)
+            {
+                arena.push_back(line[++i]);
+            }
+            else
+            {
+                arena.push_back(c);
+            }
+            i++;
+        }
+        tok.length = arena.size() - tok.offset;
+        tok.src_end = i;
+        arena.push_back('\0');
+        tokens.push_back(tok);
+    }
+}
+
+std::size_t ParsedLine::size() const
+{
+    return tokens.size();
+}
+
+bool ParsedLine::empty() const
+{
+    return tokens.empty();
+}
+
+const Token& ParsedLine::token(std::size_t i) const
+{
+    return tokens[i];
+}
+
+const char* ParsedLine::arg(std::size_t i) const
+{
+    if(i >= tokens.size())
+    {
+        return NULL;
+    }
+    return arena.data() + tokens[i].offset;
+}
+
+std::string ParsedLine::argString(std::size_t i) const
+{
+    if(i >= tokens.size())
+    {
+        return "";
+    }
+    return arena.substr(tokens[i].offset, tokens[i].length);
+}
+
+bool ParsedLine::argEquals(std::size_t i, const char* str) const
+{
+    return i < tokens.size() && tokens[i].length == strlen(str) && !arena.compare(tokens[i].offset, tokens[i].length, str);
+}
+
+bool ParsedLine::isOperator(std::size_t i) const
+{
+    return i < tokens.size() && tokens[i].type != TokenType::Word;
+}
+
+int ParsedLine::findOperator(std::size_t from) const
+{
+    for(std::size_t i = from; i < tokens.size(); i++)
+    {
+        if(tokens[i].type != TokenType::Word)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const std::string& ParsedLine::getLine() const
+{
+    return line;
+}
+
+std::string ParsedLine::sourceText(std::size_t src_begin, std::size_t src_end) const
+{
+    return line.substr(src_begin, src_end - src_begin);
+}
+
+//*************COMMAND LINE IMPLEMENTATION*************//
+static std::string trimmed(const std::string& str)
+{
+    std::size_t start = str.find_first_not_of(PARSER_WHITESPACE);
+    if(start == std::string::npos)
+    {
+        return "";
+    }
+    return str.substr(start, str.find_last_not_of(PARSER_WHITESPACE) + 1 - start);
+}
+
+CommandLine::CommandLine(const char* cmd_line) : parsed(std::make_shared<ParsedLine>(cmd_line)), text(cmd_line)
+{
+    build();
+}
+
+CommandLine::CommandLine(const std::string& cmd_line) : parsed(std::make_shared<ParsedLine>(cmd_line)), text(cmd_line)
+{
+    build();
+}
+
+/**
+ * Groups the tokens into stages. The line is marked invalid if a stage has no command,
+ * if a redirection is not followed by exactly one file name or is not on the last stage,
+ * or if a redirected line is also sent to the background.
+ */
+void CommandLine::build()
+{
+    std::size_t n = parsed->size();
+    if(n > 0 && parsed->token(n - 1).type == TokenType::Background)
+    {
+        background = true;
+        n--;
+    }
+    if(n == 0) // An empty line (or a lone '&') is not a command.
+    {
+        valid = false;
+        return;
+    }
+
+    CommandStage curr = {0, 0, false, TokenType::Word, 0};
+    for(std::size_t i = 0; i <= n; i++)
+    {
+        TokenType type = (i < n)? parsed->token(i).type : TokenType::Pipe; // The end of the line closes the last stage.
+        if(type == TokenType::Word)
+        {
+            if(curr.redirection != TokenType::Word) // Words after the file name of a redirection.
+            {
+                valid = false;
+            }
+            curr.words_end = i + 1;
+            continue;
+        }
+        if(type == TokenType::OutRed || type == TokenType::OutAppend)
+        {
+            if(curr.redirection != TokenType::Word || i + 1 >= n || parsed->token(i + 1).type != TokenType::Word)
+            {
+                valid = false;
+            }
+            else
+            {
+                curr.target_token = ++i;
+            }
+            curr.redirection = type;
+            continue;
+        }
+        // A pipe operator (or the end of the line).
+        if(curr.words_end <= curr.first_token)
+        {
+            valid = false;
+            curr.words_end = curr.first_token;
+        }
+        curr.err_pipe = (type == TokenType::ErrPipe);
+        stages.push_back(curr);
+        curr = {i + 1, i + 1, false, TokenType::Word, 0};
+    }
+
+    for(std::size_t i = 0; i + 1 < stages.size(); i++)
+    {
+        if(stages[i].redirection != TokenType::Word)
+        {
+            valid = false;
+        }
+    }
+    if(background && stages.back().redirection != TokenType::Word)
+    {
+        valid = false;
+    }
+}
+
+/**
+ * Returns the source position right after the last token that belongs to this view.
+ */
+std::size_t CommandLine::viewEnd() const
+{
+    const CommandStage& last = stages.back();
+    if(background)
+    {
+        return parsed->token(parsed->size() - 1).src_end;
+    }
+    if(last.redirection != TokenType::Word && last.target_token > 0)
+    {
+        return parsed->token(last.target_token).src_end;
+    }
+    return last.words_end > last.first_token? parsed->token(last.words_end - 1).src_end : parsed->token(last.first_token).src_begin;
+}
+
+bool CommandLine::isValid() const
+{
+    return valid;
+}
+
+bool CommandLine::isBackground() const
+{
+    return background;
+}
+
+CMD_Type CommandLine::getType() const
+{
+    if(stages.size() > 1)
+    {
+        return stages[0].err_pipe? CMD_Type::ErrPipe : CMD_Type::Pipe;
+    }
+    if(!stages.empty() && stages[0].redirection != TokenType::Word)
+    {
+        return stages[0].redirection == TokenType::OutAppend? CMD_Type::OutAppend : CMD_Type::OutRed;
+    }
+    return background? CMD_Type::Background : CMD_Type::Normal;
+}
+
+const std::string& CommandLine::getText() const
+{
+    return text;
+}
+
+std::size_t CommandLine::stageCount() const
+{
+    return stages.size();
+}
+
+CommandLine CommandLine::stage(std::size_t i) const
+{
+    CommandLine sub(*this);
+    sub.stages.assign(1, stages[i]);
+    sub.stages[0].err_pipe = false;
+    sub.background = background && (i + 1 == stages.size());
+    std::size_t begin = parsed->token(stages[i].first_token).src_begin;
+    sub.text = trimmed(parsed->getLine().substr(begin, sub.viewEnd() - begin));
+    return sub;
+}
+
+bool CommandLine::isErrPipe(std::size_t i) const
+{
+    return stages[i].err_pipe;
+}
+
+bool CommandLine::isRedirected() const
+{
+    return !stages.empty() && stages[0].redirection != TokenType::Word;
+}
+
+bool CommandLine::isAppend() const
+{
+    return !stages.empty() && stages[0].redirection == TokenType::OutAppend;
+}
+
+std::string CommandLine::redirectionTarget() const
+{
+    return isRedirected()? parsed->argString(stages[0].target_token) : "";
+}
+
+CommandLine CommandLine::withoutRedirection() const
+{
+    CommandLine sub(*this);
+    sub.stages[0].redirection = TokenType::Word;
+    sub.text = stageText();
+    return sub;
+}
+
+/**
+ * Returns the command line that remains after dropping the first n words (e.g. the command under "timeout <secs>").
+ */
+CommandLine CommandLine::shiftArgs(std::size_t n) const
+{
+    CommandLine sub(*this);
+    sub.stages[0].first_token += n;
+    if(sub.stages[0].first_token >= sub.stages[0].words_end)
+    {
+        sub.valid = false;
+        sub.stages[0].first_token = sub.stages[0].words_end;
+        sub.text = "";
+        return sub;
+    }
+    std::size_t begin = parsed->token(sub.stages[0].first_token).src_begin;
+    sub.text = trimmed(parsed->getLine().substr(begin, sub.viewEnd() - begin));
+    return sub;
+}
+
+std::size_t CommandLine::argsCount() const
+{
+    return stages.empty()? 0 : stages[0].words_end - stages[0].first_token;
+}
+
+const char* CommandLine::arg(std::size_t i) const
+{
+    return i < argsCount()? parsed->arg(stages[0].first_token + i) : NULL;
+}
+
+std::size_t CommandLine::argLength(std::size_t i) const
+{
+    return i < argsCount()? parsed->token(stages[0].first_token + i).length : 0;
+}
+
+std::string CommandLine::argString(std::size_t i) const
+{
+    return i < argsCount()? parsed->argString(stages[0].first_token + i) : "";
+}
+
+bool CommandLine::argEquals(std::size_t i, const char* str) const
+{
+    return i < argsCount() && parsed->argEquals(stages[0].first_token + i, str);
+}
+
+std::string CommandLine::stageText() const
+{
+    if(argsCount() == 0)
+    {
+        return "";
+    }
+    std::size_t begin = parsed->token(stages[0].first_token).src_begin;
+    std::size_t end = parsed->token(stages[0].words_end - 1).src_end;
+    return parsed->getLine().substr(begin, end - begin);
+}
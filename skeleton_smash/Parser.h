@@ -0,0 +1,112 @@
+#ifndef SMASH_PARSER_H_
+#define SMASH_PARSER_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+enum class CMD_Type
+{
+    Normal, Background, Pipe, ErrPipe,
+    OutRed, OutAppend
+};
+
+enum class TokenType
+{
+    Word, Pipe, ErrPipe, OutRed, OutAppend, Background
+};
+
+struct Token
+{
+    TokenType type;
+    std::size_t offset;     // Start of the (unquoted) token text inside the arena
+    std::size_t length;     // Length of the token text, not including its terminating NUL
+    std::size_t src_begin;  // Position of the token in the original command line
+    std::size_t src_end;    // One past the token's last character in the original command line
+};
+
+// A command line split into tokens in a single pass.
+// The unquoted text of every token is stored NUL-terminated, back to back, in one arena owned by the object,
+// so tokens cost no allocation of their own and arg() can be handed to exec as is.
+// Quotes ('...' and "...") and backslash escapes are removed from words, and operators inside them are plain text.
+// "|", "|&", ">", ">>" are operators wherever they appear unquoted, "&" only at the end of the line.
+class ParsedLine
+{
+    std::string line;
+    std::string arena;
+    std::vector<Token> tokens;
+
+    void tokenize();
+    void pushOperator(TokenType type, std::size_t src_begin, std::size_t src_len);
+
+public:
+    explicit ParsedLine(const char* cmd_line);
+    explicit ParsedLine(const std::string& cmd_line);
+    ~ParsedLine() = default;
+
+    std::size_t size() const;
+    bool empty() const;
+    const Token& token(std::size_t i) const;
+    const char* arg(std::size_t i) const; // NULL if i is out of range
+    std::string argString(std::size_t i) const;
+    bool argEquals(std::size_t i, const char* str) const;
+    bool isOperator(std::size_t i) const;
+    int findOperator(std::size_t from = 0) const; // Index of the first operator token at/after from, -1 if none
+    const std::string& getLine() const;
+    std::string sourceText(std::size_t src_begin, std::size_t src_end) const;
+};
+
+struct CommandStage
+{
+    std::size_t first_token;    // First word token of the stage
+    std::size_t words_end;      // One past the stage's last word token
+    bool err_pipe;              // The stage's stderr (instead of stdout) feeds the next stage
+    TokenType redirection;      // OutRed / OutAppend, or Word if the stage's output is not redirected
+    std::size_t target_token;   // The redirection's file name token
+};
+
+// The parsed form of a command line: its pipeline stages, the output redirection of the last stage and
+// the background flag. It is built once per line and handed as is through command creation and execution.
+// Sub-lines (a single stage, the command under a redirection or a timeout) are views sharing the same tokens.
+class CommandLine
+{
+    std::shared_ptr<const ParsedLine> parsed;
+    std::vector<CommandStage> stages;
+    std::string text;
+    bool background = false;
+    bool valid = true;
+
+    void build();
+    std::size_t viewEnd() const;
+
+public:
+    explicit CommandLine(const char* cmd_line);
+    explicit CommandLine(const std::string& cmd_line);
+    ~CommandLine() = default;
+
+    bool isValid() const;
+    bool isBackground() const;
+    CMD_Type getType() const;
+    const std::string& getText() const; // The command line as typed (trimmed source text for sub-lines)
+
+    std::size_t stageCount() const;
+    CommandLine stage(std::size_t i) const;
+    bool isErrPipe(std::size_t i) const;
+
+    bool isRedirected() const;
+    bool isAppend() const;
+    std::string redirectionTarget() const;
+    CommandLine withoutRedirection() const;
+    CommandLine shiftArgs(std::size_t n) const;
+
+    // The words of the first stage:
+    std::size_t argsCount() const;
+    const char* arg(std::size_t i) const; // NUL-terminated, NULL if i is out of range
+    std::size_t argLength(std::size_t i) const;
+    std::string argString(std::size_t i) const;
+    bool argEquals(std::size_t i, const char* str) const;
+    std::string stageText() const; // Source text of the first stage's words, without redirection and '&'
+};
+
+#endif //SMASH_PARSER_H_
@@ -0,0 +1,256 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "Spawn.h"
+#include "SpawnServer.h"
+#include "Exceptions.h"
+#include "Stats.h"
+
+extern char **environ;
+
+static SpawnBackend initialBackend()
+{
+#ifdef SMASH_SPAWN_FORK
+    SpawnBackend backend = SpawnBackend::Fork;
+#else
+    SpawnBackend backend = SpawnBackend::PosixSpawn;
+#endif
+    const char* env = getenv("SMASH_SPAWN");
+    if(env)
+    {
+        parseSpawnBackend(env, &backend);
+    }
+    return backend;
+}
+
+static SpawnBackend curr_backend = initialBackend();
+
+SpawnBackend getSpawnBackend()
+{
+    return curr_backend;
+}
+
+void setSpawnBackend(SpawnBackend backend)
+{
+    curr_backend = backend;
+}
+
+/**
+ * Translates a backend name ("fork" / "spawn") to a SpawnBackend.
+ * Returns false if the name is unknown, in which case backend is left untouched.
+ */
+bool parseSpawnBackend(const std::string& name, SpawnBackend* backend)
+{
+    if(name == "fork")
+    {
+        *backend = SpawnBackend::Fork;
+        return true;
+    }
+    if(name == "spawn" || name == "posix_spawn")
+    {
+        *backend = SpawnBackend::PosixSpawn;
+        return true;
+    }
+    if(name == "zygote")
+    {
+        *backend = SpawnBackend::Zygote;
+        return true;
+    }
+    return false;
+}
+
+static std::vector<char*> buildArgv(const SpawnRequest& req)
+{
+    std::vector<char*> argv;
+    argv.reserve(req.argv.size() + 1);
+    for(const char* arg : req.argv)
+    {
+        argv.push_back(const_cast<char*>(arg));
+    }
+    argv.push_back(NULL);
+    return argv;
+}
+
+/**
+ * The kernel counts every string with its NUL and every pointer of argv and envp against ARG_MAX.
+ */
+bool argvFits(const std::vector<const char*>& argv)
+{
+    static long arg_max = sysconf(_SC_ARG_MAX);
+    if(arg_max <= 0)
+    {
+        return true; // No limit we can tell, let exec decide.
+    }
+    std::size_t total = 2 * sizeof(char*); // The NULL terminators of argv and envp
+    for(const char* arg : argv)
+    {
+        total += strlen(arg) + 1 + sizeof(char*);
+    }
+    for(char** env = environ; *env; env++)
+    {
+        total += strlen(*env) + 1 + sizeof(char*);
+    }
+    return total <= static_cast<std::size_t>(arg_max);
+}
+
+/**
+ * Like posix_spawn, a failed dup2 or exec in the child is thrown in the parent (so a direct exec can fall back to
+ * bash): the child writes errno and the failed step to a close-on-exec pipe, EOF means the exec succeeded.
+ */
+static pid_t forkSpawn(const SpawnRequest& req, std::vector<char*>& argv)
+{
+    int err_pipe[2];
+    if(pipe2(err_pipe, O_CLOEXEC) == -1)
+    {
+        throw SyscallError("pipe2");
+    }
+    pid_t c_pid = fork();
+    if(c_pid == -1)
+    {
+        int fork_errno = errno;
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        errno = fork_errno;
+        throw SyscallError("fork");
+    }
+    if(c_pid == 0) // Child: never return to the smash code from here.
+    {
+        close(err_pipe[0]);
+        int report[2] = {0, 0}; // errno, then 0 if dup2 failed or 1 if the exec did
+        if(req.new_pgrp)
+        {
+            setpgrp();
+        }
+        bool duped = true;
+        for(auto& fds : req.dup_fds)
+        {
+            if(dup2(fds.first, fds.second) == -1)
+            {
+                duped = false;
+                break;
+            }
+        }
+        if(duped)
+        {
+            for(int fd : req.close_fds)
+            {
+                close(fd);
+            }
+            report[1] = 1;
+            execv(req.path.c_str(), argv.data());
+        }
+        report[0] = errno;
+        ssize_t res = write(err_pipe[1], report, sizeof(report));
+        (void)res;
+        _exit(127);
+    }
+    close(err_pipe[1]);
+    int report[2];
+    ssize_t got;
+    while((got = read(err_pipe[0], report, sizeof(report))) == -1 && errno == EINTR) { }
+    close(err_pipe[0]);
+    if(got == sizeof(report))
+    {
+        waitpid(c_pid, NULL, 0); // Reap it before anyone mistakes it for a job.
+        errno = report[0];
+        throw SyscallError(report[1]? "execv" : "dup2");
+    }
+    return c_pid;
+}
+
+static pid_t posixSpawn(const SpawnRequest& req, std::vector<char*>& argv)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t c_pid = 0;
+    int err;
+
+    if((err = posix_spawn_file_actions_init(&actions)))
+    {
+        errno = err;
+        throw SyscallError("posix_spawn_file_actions_init");
+    }
+    if((err = posix_spawnattr_init(&attr)))
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        throw SyscallError("posix_spawnattr_init");
+    }
+
+    for(auto& fds : req.dup_fds)
+    {
+        posix_spawn_file_actions_adddup2(&actions, fds.first, fds.second);
+    }
+    for(int fd : req.close_fds)
+    {
+        posix_spawn_file_actions_addclose(&actions, fd);
+    }
+    if(req.new_pgrp)
+    {
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    }
+
+    err = posix_spawn(&c_pid, req.path.c_str(), &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if(err)
+    {
+        errno = err;
+        throw SyscallError("posix_spawn");
+    }
+    return c_pid;
+}
+
+int openPidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0); // pidfds are always close-on-exec.
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int signalChild(pid_t pid, int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+    if(pidfd != -1)
+    {
+        return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+    }
+#endif
+    return kill(pid, sig);
+}
+
+pid_t spawnProcess(const SpawnRequest& req)
+{
+    STATS_SCOPE(StatPhase::Spawn);
+    if(!argvFits(req.argv)) // Fail before forking, like exec would.
+    {
+        errno = E2BIG;
+        throw SyscallError("execv");
+    }
+    if(curr_backend == SpawnBackend::Zygote && spawnServerAvailable())
+    {
+        pid_t c_pid = spawnServerSpawn(req);
+        if(c_pid != -1)
+        {
+            return c_pid;
+        }
+        // The server could not take the request (or is gone): launch it from here.
+    }
+    std::vector<char*> argv = buildArgv(req);
+    if(curr_backend == SpawnBackend::Fork)
+    {
+        return forkSpawn(req, argv);
+    }
+    return posixSpawn(req, argv);
+}
@@ -0,0 +1,45 @@
+#ifndef SMASH_SPAWN_H_
+#define SMASH_SPAWN_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+// Build with -DSMASH_SPAWN_FORK to make fork() the default backend.
+// The default can be overridden at runtime with SMASH_SPAWN=fork|spawn|zygote in the environment.
+// zygote launches children through the spawn server (SpawnServer.h), falling back to posix_spawn without it.
+enum class SpawnBackend
+{
+    Fork, PosixSpawn, Zygote
+};
+
+struct SpawnRequest
+{
+    std::string path;                           // Executable to run (already resolved).
+    std::vector<const char*> argv;              // Arguments, argv[0] included. Borrowed: they must outlive the spawn.
+    std::string script;                         // Owned storage argv may point into (the line of a bash -c).
+    std::vector<std::pair<int, int>> dup_fds;   // (old_fd, new_fd) pairs to dup2 in the child, in order.
+    std::vector<int> close_fds;                 // Fds to close in the child after the dup2s.
+    bool new_pgrp = true;                       // Move the child to its own process group (setpgrp).
+};
+
+SpawnBackend getSpawnBackend();
+void setSpawnBackend(SpawnBackend backend);
+bool parseSpawnBackend(const std::string& name, SpawnBackend* backend);
+
+// Launches a child according to req using the current backend and returns its pid.
+// Throws SyscallError if the child could not be created (or, when the backend can tell, not exec'ed).
+pid_t spawnProcess(const SpawnRequest& req);
+
+// Returns true if argv and the environment fit in the kernel's limit on exec arguments (ARG_MAX).
+bool argvFits(const std::vector<const char*>& argv);
+
+// Returns a close-on-exec pidfd for the child pid, or -1 if the kernel does not support pidfds.
+// Race-free for a child we have not reaped yet: its pid cannot be reused before we wait for it.
+int openPidfd(pid_t pid);
+
+// Sends sig to the child through pidfd when there is one (it can never reach a recycled pid), with kill(pid) otherwise.
+int signalChild(pid_t pid, int pidfd, int sig);
+
+#endif //SMASH_SPAWN_H_
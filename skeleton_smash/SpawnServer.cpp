@@ -0,0 +1,370 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "SpawnServer.h"
+#include "Exceptions.h"
+
+struct RequestHeader
+{
+    uint32_t length;                        // Bytes of the strings that follow: path, cwd and argv, each NUL-terminated
+    uint32_t argc;
+    uint32_t fd_count;                      // fds attached with SCM_RIGHTS, the i'th one is installed as targets[i]
+    uint32_t new_pgrp;
+    int32_t targets[SPAWN_SERVER_MAX_FDS];
+};
+
+enum class SpawnStep : int32_t
+{
+    Clone, Chdir, Dup2, Exec
+};
+
+struct Reply
+{
+    int32_t pid;    // -1 if the child could not be created
+    int32_t error;  // errno of the failed step, 0 on success
+    SpawnStep step;
+};
+
+static const char* const STEP_NAMES[] = {"clone", "chdir", "dup2", "execv"};
+
+static int server_sock = -1;
+static pid_t owner_pid = 0;
+
+//*****************SHARED HELPERS*****************//
+static bool readFull(int fd, void* buf, std::size_t len)
+{
+    char* data = static_cast<char*>(buf);
+    while(len)
+    {
+        ssize_t res = read(fd, data, len);
+        if(res == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(res <= 0)
+        {
+            return false;
+        }
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+static bool sendFull(int fd, const void* buf, std::size_t len)
+{
+    const char* data = static_cast<const char*>(buf);
+    while(len)
+    {
+        ssize_t res = send(fd, data, len, MSG_NOSIGNAL);
+        if(res == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(res <= 0)
+        {
+            return false;
+        }
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+//*****************SERVER SIDE*****************//
+/**
+ * Receives the next request: its header, the fds attached to it and its strings.
+ * Returns false on EOF (smash is gone) or on a malformed request.
+ */
+static bool receiveRequest(int sock, RequestHeader& hdr, int* fds, std::vector<char>& strings)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t res;
+    do
+    {
+        res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while(res == -1 && errno == EINTR);
+    if(res <= 0)
+    {
+        return false;
+    }
+    uint32_t received = 0;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds + received, CMSG_DATA(cmsg), count * sizeof(int));
+            received += count;
+        }
+    }
+    bool valid = (static_cast<std::size_t>(res) == sizeof(hdr) || readFull(sock, reinterpret_cast<char*>(&hdr) + res, sizeof(hdr) - res));
+    valid = valid && hdr.fd_count == received && hdr.argc > 0;
+    if(valid)
+    {
+        strings.resize(hdr.length);
+        valid = readFull(sock, strings.data(), hdr.length) && hdr.length && strings.back() == '\0';
+    }
+    if(!valid)
+    {
+        for(uint32_t i = 0; i < received; i++)
+        {
+            close(fds[i]);
+        }
+    }
+    return valid;
+}
+
+/**
+ * The cloned child: only async-signal-safe calls from here on. A failure is reported through err_fd.
+ */
+static void runChild(const RequestHeader& hdr, const int* fds, const char* path, const char* cwd,
+    std::vector<char*>& argv, int err_fd)
+{
+    int32_t report[2] = {0, static_cast<int32_t>(SpawnStep::Chdir)};
+    signal(SIGINT, SIG_DFL); // Ignored by the server, ignored dispositions would survive the exec.
+    signal(SIGTSTP, SIG_DFL);
+    if(hdr.new_pgrp)
+    {
+        setpgrp();
+    }
+    if(chdir(cwd) == 0)
+    {
+        report[1] = static_cast<int32_t>(SpawnStep::Dup2);
+        uint32_t i = 0;
+        for(; i < hdr.fd_count; i++)
+        {
+            // The received fds are close-on-exec. dup2 clears the flag on the copy, but not on an fd installed as itself.
+            int res = (fds[i] == hdr.targets[i])? fcntl(fds[i], F_SETFD, 0) : dup2(fds[i], hdr.targets[i]);
+            if(res == -1)
+            {
+                break;
+            }
+        }
+        if(i == hdr.fd_count)
+        {
+            report[1] = static_cast<int32_t>(SpawnStep::Exec);
+            execv(path, argv.data());
+        }
+    }
+    report[0] = errno;
+    ssize_t res = write(err_fd, report, sizeof(report));
+    (void)res;
+    _exit(127);
+}
+
+/**
+ * Launches one request and fills reply. The child is cloned with CLONE_PARENT: it is smash's child, not ours.
+ * The exec result comes back through a close-on-exec pipe: EOF means the exec succeeded.
+ */
+static void serveRequest(const RequestHeader& hdr, const int* fds, std::vector<char>& strings, Reply& reply)
+{
+    const char* path = strings.data();
+    const char* cwd = path + strlen(path) + 1;
+    std::vector<char*> argv;
+    argv.reserve(hdr.argc + 1);
+    for(char* arg = const_cast<char*>(cwd) + strlen(cwd) + 1; argv.size() < hdr.argc && arg < strings.data() + strings.size();
+        arg += strlen(arg) + 1)
+    {
+        argv.push_back(arg);
+    }
+    argv.push_back(NULL);
+
+    reply = {-1, 0, SpawnStep::Clone};
+    int err_pipe[2];
+    if(pipe2(err_pipe, O_CLOEXEC) == -1)
+    {
+        reply.error = errno;
+        return;
+    }
+    pid_t c_pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if(c_pid == 0)
+    {
+        close(err_pipe[0]);
+        runChild(hdr, fds, path, cwd, argv, err_pipe[1]);
+    }
+    int clone_errno = errno;
+    close(err_pipe[1]);
+    reply.pid = c_pid;
+    if(c_pid == -1)
+    {
+        reply.error = clone_errno;
+    }
+    else
+    {
+        int32_t report[2];
+        if(readFull(err_pipe[0], report, sizeof(report)))
+        {
+            reply.error = report[0];
+            reply.step = static_cast<SpawnStep>(report[1]);
+        }
+    }
+    close(err_pipe[0]);
+}
+
+static void serverMain(int sock)
+{
+    signal(SIGINT, SIG_IGN); // Ctrl-C and Ctrl-Z at the terminal are meant for smash's jobs.
+    signal(SIGTSTP, SIG_IGN);
+    RequestHeader hdr;
+    int fds[SPAWN_SERVER_MAX_FDS];
+    std::vector<char> strings;
+    Reply reply;
+    while(receiveRequest(sock, hdr, fds, strings))
+    {
+        serveRequest(hdr, fds, strings, reply);
+        for(uint32_t i = 0; i < hdr.fd_count; i++)
+        {
+            close(fds[i]);
+        }
+        if(!sendFull(sock, &reply, sizeof(reply)))
+        {
+            break;
+        }
+    }
+    _exit(0); // Never flush the stdio buffers inherited from smash.
+}
+
+//*****************SMASH SIDE*****************//
+bool startSpawnServer()
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        return false;
+    }
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        int fork_errno = errno;
+        close(sv[0]);
+        close(sv[1]);
+        errno = fork_errno;
+        return false;
+    }
+    if(pid == 0)
+    {
+        close(sv[0]);
+        serverMain(sv[1]);
+    }
+    close(sv[1]);
+    server_sock = sv[0];
+    owner_pid = getpid();
+    return true;
+}
+
+bool spawnServerAvailable()
+{
+    return server_sock != -1 && getpid() == owner_pid;
+}
+
+/**
+ * Drops the connection after an I/O error. The server exits on EOF if it is still alive and, being smash's child,
+ * is reaped with the other children.
+ */
+static void stopSpawnServer()
+{
+    close(server_sock);
+    server_sock = -1;
+}
+
+static void appendString(std::vector<char>& strings, const char* str)
+{
+    strings.insert(strings.end(), str, str + strlen(str) + 1);
+}
+
+pid_t spawnServerSpawn(const SpawnRequest& req)
+{
+    if(req.dup_fds.size() > SPAWN_SERVER_MAX_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    std::vector<char> cwd(256);
+    while(getcwd(cwd.data(), cwd.size()) == NULL)
+    {
+        if(errno != ERANGE)
+        {
+            return -1;
+        }
+        cwd.resize(cwd.size() * 2);
+    }
+    std::vector<char> strings;
+    appendString(strings, req.path.c_str());
+    appendString(strings, cwd.data());
+    for(const char* arg : req.argv)
+    {
+        appendString(strings, arg);
+    }
+
+    RequestHeader hdr = {};
+    hdr.length = strings.size();
+    hdr.argc = req.argv.size();
+    hdr.fd_count = req.dup_fds.size();
+    hdr.new_pgrp = req.new_pgrp;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(hdr.fd_count)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * hdr.fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * hdr.fd_count);
+        int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+        for(uint32_t i = 0; i < hdr.fd_count; i++)
+        {
+            fds[i] = req.dup_fds[i].first;
+            hdr.targets[i] = req.dup_fds[i].second;
+        }
+    }
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(server_sock, &msg, MSG_NOSIGNAL);
+    } while(sent == -1 && errno == EINTR);
+    Reply reply;
+    if(sent <= 0 || !sendFull(server_sock, reinterpret_cast<char*>(&hdr) + sent, sizeof(hdr) - sent) ||
+        !sendFull(server_sock, strings.data(), strings.size()) || !readFull(server_sock, &reply, sizeof(reply)))
+    {
+        stopSpawnServer();
+        errno = EPIPE;
+        return -1;
+    }
+    if(reply.error)
+    {
+        if(reply.pid > 0)
+        {
+            waitpid(reply.pid, NULL, 0); // Our child: reap it before anyone mistakes it for a job.
+        }
+        errno = reply.error;
+        throw SyscallError(STEP_NAMES[static_cast<int>(reply.step)]);
+    }
+    return reply.pid;
+}
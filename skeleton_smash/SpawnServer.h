@@ -0,0 +1,26 @@
+#ifndef SMASH_SPAWN_SERVER_H_
+#define SMASH_SPAWN_SERVER_H_
+
+#include <vector>
+#include <sys/types.h>
+#include "Spawn.h"
+
+// The spawn server ("zygote") is a small helper forked from smash at startup, before smash grows.
+// Spawn requests (path, argv, cwd, process group and the fds to install, passed with SCM_RIGHTS) go to it over a
+// UNIX socketpair. It clones each child with CLONE_PARENT, so the child is still smash's own: smash waits for it,
+// signals it and opens its pidfd exactly as if it had forked it, but never copies its own address space to do so.
+
+#define SPAWN_SERVER_MAX_FDS (8) // dup_fds entries a single request can carry
+
+// Forks the server. Must be called before any signal handler is installed. Returns false (with errno set) on failure.
+bool startSpawnServer();
+
+// True if the server is running and may be used from this process (a forked smash child must not share it).
+bool spawnServerAvailable();
+
+// Launches req through the server and returns the child's pid.
+// Throws SyscallError if the child could not be created or exec'ed (a failed child is reaped before returning).
+// Returns -1 with errno set if the server itself is gone, after which spawnServerAvailable() is false.
+pid_t spawnServerSpawn(const SpawnRequest& req);
+
+#endif //SMASH_SPAWN_SERVER_H_
@@ -0,0 +1,106 @@
+#include <string.h>
+#include <iomanip>
+#include "Stats.h"
+
+static PhaseStats phase_stats[static_cast<int>(StatPhase::Count)];
+static CopyStats copy_stats;
+
+static const char* const PHASE_NAMES[] = {"parse", "create", "execute", "spawn", "wait", "reap", "signal"};
+
+StatTimer::StatTimer(StatPhase phase) : phase(phase), start(monotonicNs()) { }
+
+StatTimer::~StatTimer()
+{
+    statsRecord(phase, monotonicNs() - start);
+}
+
+void statsRecord(StatPhase phase, long long elapsed_ns)
+{
+    PhaseStats& stats = phase_stats[static_cast<int>(phase)];
+    unsigned long long ns = (elapsed_ns > 0)? elapsed_ns : 0;
+    int bucket = ns? 63 - __builtin_clzll(ns) : 0; // floor(log2(ns))
+    if(bucket >= STATS_BUCKETS)
+    {
+        bucket = STATS_BUCKETS - 1;
+    }
+    stats.count++;
+    stats.total_ns += ns;
+    if(ns > stats.max_ns)
+    {
+        stats.max_ns = ns;
+    }
+    stats.buckets[bucket]++;
+}
+
+void statsRecordCopy(unsigned long long files, unsigned long long bytes, long long elapsed_ns)
+{
+    copy_stats.files += files;
+    copy_stats.bytes += bytes;
+    copy_stats.total_ns += (elapsed_ns > 0)? elapsed_ns : 0;
+}
+
+const PhaseStats& statsGet(StatPhase phase)
+{
+    return phase_stats[static_cast<int>(phase)];
+}
+
+const char* statsPhaseName(StatPhase phase)
+{
+    return PHASE_NAMES[static_cast<int>(phase)];
+}
+
+void statsReset()
+{
+    memset(phase_stats, 0, sizeof(phase_stats));
+    memset(&copy_stats, 0, sizeof(copy_stats));
+}
+
+/**
+ * Prints a line per phase: count, total, average and maximum (in microseconds).
+ * With histograms, every non-empty bucket is printed as <lower bound in ns>:<count>.
+ * If cat copied anything, a last line gives its throughput in files/s and MB/s.
+ */
+void statsPrint(std::ostream& out, bool histograms)
+{
+#ifdef SMASH_NO_STATS
+    out << "smash: stats were compiled out of this build" << '\n';
+#endif
+    out << std::left << std::setw(10) << "phase" << std::right << std::setw(10) << "count" << std::setw(14) << "total_us"
+        << std::setw(12) << "avg_us" << std::setw(12) << "max_us" << '\n';
+    out << std::fixed << std::setprecision(1);
+    for(int i = 0; i < static_cast<int>(StatPhase::Count); i++)
+    {
+        const PhaseStats& stats = phase_stats[i];
+        double avg_us = stats.count? stats.total_ns / 1000.0 / stats.count : 0;
+        out << std::left << std::setw(10) << PHASE_NAMES[i] << std::right << std::setw(10) << stats.count
+            << std::setw(14) << stats.total_ns / 1000.0 << std::setw(12) << avg_us << std::setw(12) << stats.max_ns / 1000.0 << '\n';
+        if(histograms && stats.count)
+        {
+            out << "  ";
+            for(int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+            {
+                if(stats.buckets[bucket])
+                {
+                    out << " " << (1ULL << bucket) << ":" << stats.buckets[bucket];
+                }
+            }
+            out << '\n';
+        }
+    }
+    if(copy_stats.files)
+    {
+        double secs = copy_stats.total_ns / 1e9;
+        double mb = copy_stats.bytes / (1024.0 * 1024.0);
+        out << "cat: " << copy_stats.files << " files " << mb << " MB in " << secs * 1000 << " ms, ";
+        if(secs > 0)
+        {
+            out << copy_stats.files / secs << " files/s " << mb / secs << " MB/s" << '\n';
+        }
+        else
+        {
+            out << "- files/s - MB/s" << '\n';
+        }
+    }
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(6);
+}
@@ -0,0 +1,61 @@
+#ifndef SMASH_STATS_H_
+#define SMASH_STATS_H_
+
+#include <ostream>
+#include "Clock.h"
+
+// Per-phase counters and latency histograms of the hot paths, shown by the stats builtin.
+// Build with -DSMASH_NO_STATS to compile the instrumentation (STATS_SCOPE, STATS_START/STATS_COPY) out.
+enum class StatPhase
+{
+    Parse, Create, Execute, Spawn, Wait, Reap, Signal, Count
+};
+
+#define STATS_BUCKETS (32) // Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one everything above.
+
+struct PhaseStats
+{
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[STATS_BUCKETS];
+};
+
+// Throughput of cat: the files and bytes it copied and the time it spent on them.
+struct CopyStats
+{
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long total_ns;
+};
+
+void statsRecord(StatPhase phase, long long elapsed_ns);
+void statsRecordCopy(unsigned long long files, unsigned long long bytes, long long elapsed_ns);
+const PhaseStats& statsGet(StatPhase phase);
+const char* statsPhaseName(StatPhase phase);
+void statsReset();
+void statsPrint(std::ostream& out, bool histograms);
+
+// Records the time from its construction to its destruction under phase.
+class StatTimer
+{
+    StatPhase phase;
+    long long start;
+public:
+    explicit StatTimer(StatPhase phase);
+    ~StatTimer();
+};
+
+#ifndef SMASH_NO_STATS
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_SCOPE(phase) StatTimer STATS_CONCAT(stat_timer_, __LINE__)(phase)
+#define STATS_START(var) long long var = monotonicNs()
+#define STATS_COPY(files, bytes, start) statsRecordCopy(files, bytes, monotonicNs() - (start))
+#else
+#define STATS_SCOPE(phase)
+#define STATS_START(var)
+#define STATS_COPY(files, bytes, start)
+#endif
+
+#endif //SMASH_STATS_H_
@@ -0,0 +1,615 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "Commands.h"
+#include "Parser.h"
+#include "EventLoop.h"
+#include "Spawn.h"
+#include "SpawnServer.h"
+#include "Clock.h"
+
+// Links against every smash object but smash.cpp, drives SmallShell::executeCommand (and the smash binary, with -b)
+// and prints the results as a single JSON object on stdout. Whatever the benchmarked commands print goes to /dev/null.
+
+#define BENCH_DEFAULT_ITERATIONS (200)
+#define BENCH_DEFAULT_FILE_MB (256)     // Size of the file cat and the pipeline copy (-m 4096 for multi-GB runs)
+#define BENCH_DEFAULT_BALLAST_MB (256)  // Memory touched before the second spawn run: fork's cost grows with the RSS
+#define BENCH_PARSE_ROUNDS (20000)
+#define BENCH_COPY_ROUNDS (3)
+#define BENCH_TIMEOUT_ROUNDS (20)
+#define BENCH_REAP_ROUNDS (50)
+#define BENCH_E2E_ROUNDS (5)            // Runs of the binary per measurement, the fastest one counts
+#define BENCH_MB (1024 * 1024)
+
+extern char** environ;
+
+struct BenchConfig
+{
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    long long file_mb = BENCH_DEFAULT_FILE_MB;
+    long long ballast_mb = BENCH_DEFAULT_BALLAST_MB;
+    std::string dir = "/tmp";
+    std::string smash_path; // End-to-end runs of the binary, skipped if empty
+};
+
+//*****************JSON OUTPUT*****************//
+// Just enough of a writer for nested objects and arrays of numbers and strings.
+class JsonWriter
+{
+    std::ostream& out;
+    std::vector<bool> first; // Per open object/array: nothing written in it yet
+
+    void separate()
+    {
+        if(!first.empty())
+        {
+            out << (first.back()? "" : ",") << '\n' << std::string(2 * first.size(), ' ');
+            first.back() = false;
+        }
+    }
+    void key(const char* name)
+    {
+        separate();
+        if(name)
+        {
+            out << '"' << name << "\": ";
+        }
+    }
+
+public:
+    explicit JsonWriter(std::ostream& out) : out(out) { }
+    void beginObject(const char* name = NULL)
+    {
+        key(name);
+        out << '{';
+        first.push_back(true);
+    }
+    void beginArray(const char* name)
+    {
+        key(name);
+        out << '[';
+        first.push_back(true);
+    }
+    void end(char closing)
+    {
+        first.pop_back();
+        out << '\n' << std::string(2 * first.size(), ' ') << closing;
+    }
+    void endObject()
+    {
+        end('}');
+    }
+    void endArray()
+    {
+        end(']');
+    }
+    void field(const char* name, long long value)
+    {
+        key(name);
+        out << value;
+    }
+    void field(const char* name, double value)
+    {
+        key(name);
+        out << value;
+    }
+    void field(const char* name, const std::string& value)
+    {
+        key(name);
+        out << '"' << value << '"';
+    }
+};
+
+/**
+ * Writes count, mean, min, median, 99th percentile and max of samples (scaled by unit) as an object.
+ */
+static void writeSummary(JsonWriter& json, const char* name, std::vector<long long> samples, double unit)
+{
+    json.beginObject(name);
+    json.field("count", static_cast<long long>(samples.size()));
+    if(!samples.empty())
+    {
+        std::sort(samples.begin(), samples.end());
+        double total = 0;
+        for(long long sample : samples)
+        {
+            total += sample;
+        }
+        json.field("mean", total / samples.size() / unit);
+        json.field("min", samples.front() / unit);
+        json.field("p50", samples[samples.size() / 2] / unit);
+        json.field("p99", samples[(samples.size() * 99) / 100] / unit);
+        json.field("max", samples.back() / unit);
+    }
+    json.endObject();
+}
+
+//*****************HELPERS*****************//
+/**
+ * Runs cmd_line through smash rounds times and returns the wall time of each run in ns.
+ */
+static std::vector<long long> timeCommand(const std::string& cmd_line, int rounds)
+{
+    SmallShell& smash = SmallShell::getInstance();
+    std::vector<long long> samples;
+    samples.reserve(rounds);
+    for(int i = 0; i < rounds; i++)
+    {
+        long long start = monotonicNs();
+        smash.executeCommand(cmd_line.c_str());
+        samples.push_back(monotonicNs() - start);
+        std::cout.flush();
+    }
+    return samples;
+}
+
+static std::vector<long long> toThroughput(const std::vector<long long>& samples_ns, long long bytes)
+{
+    std::vector<long long> mb_s; // In KB/s, so the integers keep three digits once scaled back to MB/s.
+    for(long long ns : samples_ns)
+    {
+        mb_s.push_back(ns? (bytes * 1000000000.0 / ns) / 1024 : 0);
+    }
+    return mb_s;
+}
+
+static bool writeTestFile(const std::string& path, long long mb)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1)
+    {
+        return false;
+    }
+    std::vector<char> block(BENCH_MB);
+    for(std::size_t i = 0; i < block.size(); i++)
+    {
+        block[i] = 'a' + i % 26;
+    }
+    bool ok = true;
+    for(long long i = 0; i < mb && ok; i++)
+    {
+        ok = (write(fd, block.data(), block.size()) == static_cast<ssize_t>(block.size()));
+    }
+    return close(fd) == 0 && ok;
+}
+
+static const char* backendName(SpawnBackend backend)
+{
+    switch(backend)
+    {
+        case SpawnBackend::Fork:
+            return "fork";
+        case SpawnBackend::PosixSpawn:
+            return "posix_spawn";
+        default:
+            return "zygote";
+    }
+}
+
+static std::vector<SpawnBackend> availableBackends()
+{
+    std::vector<SpawnBackend> backends = {SpawnBackend::Fork, SpawnBackend::PosixSpawn};
+    if(spawnServerAvailable())
+    {
+        backends.push_back(SpawnBackend::Zygote);
+    }
+    return backends;
+}
+
+//*****************BENCHMARKS*****************//
+// The removed per-token parser: an istringstream over a copy of the line and a malloc'ed copy of every word.
+static int referenceParse(const char* cmd_line, char** args)
+{
+    int i = 0;
+    std::istringstream iss((std::string(cmd_line)));
+    for(std::string s; iss >> s;)
+    {
+        args[i] = static_cast<char*>(malloc(s.length() + 1));
+        strcpy(args[i], s.c_str());
+        args[++i] = NULL;
+    }
+    return i;
+}
+
+/**
+ * The tokenizer (CommandLine) against the istringstream/malloc parser it replaced, in ns per line.
+ */
+static void benchParse(JsonWriter& json)
+{
+    const char* const lines[] = {
+        "showpid",
+        "sleep 10 &",
+        "ls -l /usr/bin /usr/lib /usr/share /etc /var /tmp",
+        "cat a.txt b.txt c.txt | grep -v foo |& wc -l > counts.txt",
+        "echo \"a quoted | word\" 'and > another' plain\\ escaped"
+    };
+    const std::size_t line_count = sizeof(lines) / sizeof(lines[0]);
+    std::size_t words = 0;
+    long long start = monotonicNs();
+    for(int round = 0; round < BENCH_PARSE_ROUNDS; round++)
+    {
+        for(std::size_t i = 0; i < line_count; i++)
+        {
+            CommandLine cmd_line(lines[i]);
+            words += cmd_line.argsCount();
+        }
+    }
+    long long parser_ns = monotonicNs() - start;
+
+    std::vector<char*> args(64);
+    start = monotonicNs();
+    for(int round = 0; round < BENCH_PARSE_ROUNDS; round++)
+    {
+        for(std::size_t i = 0; i < line_count; i++)
+        {
+            int count = referenceParse(lines[i], args.data());
+            words += count;
+            for(int j = 0; j < count; j++)
+            {
+                free(args[j]);
+            }
+        }
+    }
+    long long reference_ns = monotonicNs() - start;
+
+    double parsed = static_cast<double>(BENCH_PARSE_ROUNDS) * line_count;
+    json.beginObject("parse");
+    json.field("lines", static_cast<long long>(parsed));
+    json.field("tokenizer_ns_per_line", parser_ns / parsed);
+    json.field("istringstream_ns_per_line", reference_ns / parsed);
+    json.field("words", static_cast<long long>(words)); // Keeps both loops from being optimized away.
+    json.endObject();
+}
+
+/**
+ * Prompt-to-exit latency of executeCommand for builtins and for an external command under every spawn backend.
+ */
+static void benchLatency(JsonWriter& json, const BenchConfig& config)
+{
+    SpawnBackend original = getSpawnBackend();
+    json.beginObject("latency_us");
+    writeSummary(json, "builtin_showpid", timeCommand("showpid", config.iterations), 1e3);
+    writeSummary(json, "builtin_pwd", timeCommand("pwd", config.iterations), 1e3);
+    json.beginObject("external_true");
+    for(SpawnBackend backend : availableBackends())
+    {
+        setSpawnBackend(backend);
+        writeSummary(json, backendName(backend), timeCommand("true", config.iterations), 1e3);
+    }
+    json.endObject();
+    writeSummary(json, "external_bash", timeCommand("true && true", config.iterations), 1e3);
+    json.endObject();
+    setSpawnBackend(original);
+}
+
+/**
+ * spawnProcess() alone (the time until it returns) and spawn-to-reap, per backend.
+ */
+static void benchSpawnBackends(JsonWriter& json, const BenchConfig& config, long long rss_mb)
+{
+    SpawnBackend original = getSpawnBackend();
+    SpawnRequest req;
+    req.path = "/bin/true";
+    req.argv = {"true"};
+    json.beginObject();
+    json.field("ballast_mb", rss_mb);
+    for(SpawnBackend backend : availableBackends())
+    {
+        setSpawnBackend(backend);
+        std::vector<long long> spawn_ns, total_ns;
+        for(int i = 0; i < config.iterations; i++)
+        {
+            long long start = monotonicNs();
+            pid_t pid = spawnProcess(req);
+            long long spawned = monotonicNs();
+            waitpid(pid, NULL, 0);
+            long long reaped = monotonicNs();
+            spawn_ns.push_back(spawned - start);
+            total_ns.push_back(reaped - start);
+        }
+        json.beginObject(backendName(backend));
+        writeSummary(json, "spawn_us", spawn_ns, 1e3);
+        writeSummary(json, "spawn_to_reap_us", total_ns, 1e3);
+        json.endObject();
+    }
+    json.endObject();
+    setSpawnBackend(original);
+    dispatchSignals(false); // Drain the SIGCHLDs: the children were reaped here already.
+}
+
+static void benchSpawn(JsonWriter& json, const BenchConfig& config)
+{
+    json.beginArray("spawn");
+    benchSpawnBackends(json, config, 0);
+    std::vector<char> ballast(config.ballast_mb * BENCH_MB);
+    for(std::size_t i = 0; i < ballast.size(); i += 4096) // Touch every page, so it is really part of the RSS.
+    {
+        ballast[i] = 1;
+    }
+    benchSpawnBackends(json, config, config.ballast_mb);
+    json.endArray();
+}
+
+/**
+ * MB/s of a two-stage external pipeline and of cat to a file, to a character device and into a pipe.
+ */
+static void benchThroughput(JsonWriter& json, const BenchConfig& config)
+{
+    long long bytes = config.file_mb * BENCH_MB;
+    std::string src = config.dir + "/smash_bench_src." + std::to_string(getpid());
+    std::string dst = config.dir + "/smash_bench_dst." + std::to_string(getpid());
+    json.beginObject("throughput_mb_s");
+    json.field("bytes", bytes);
+    writeSummary(json, "pipe", toThroughput(timeCommand("head -c " + std::to_string(bytes) + " /dev/zero | wc -c",
+        BENCH_COPY_ROUNDS), bytes), 1024);
+    if(writeTestFile(src, config.file_mb))
+    {
+        writeSummary(json, "cat_to_file", toThroughput(timeCommand("cat " + src + " > " + dst, BENCH_COPY_ROUNDS), bytes), 1024);
+        writeSummary(json, "cat_to_devnull", toThroughput(timeCommand("cat " + src + " > /dev/null", BENCH_COPY_ROUNDS), bytes), 1024);
+        writeSummary(json, "cat_to_pipe", toThroughput(timeCommand("cat " + src + " | wc -c", BENCH_COPY_ROUNDS), bytes), 1024);
+    }
+    else
+    {
+        perror("smash_bench: cannot write the test file");
+    }
+    unlink(src.c_str());
+    unlink(dst.c_str());
+    json.endObject();
+}
+
+// A job table entry without a process. Its pid is above pid_max, so no real child can ever match it.
+class PlaceholderJob : public Command
+{
+public:
+    PlaceholderJob(const CommandLine& cmd_line, pid_t pid) : Command(cmd_line, true, pid) { }
+    void execute() override { }
+};
+
+static pid_t pidMax()
+{
+    long long pid_max = 4194304; // The largest pid_max Linux allows
+    FILE* file = fopen("/proc/sys/kernel/pid_max", "r");
+    if(file)
+    {
+        if(fscanf(file, "%lld", &pid_max) != 1)
+        {
+            pid_max = 4194304;
+        }
+        fclose(file);
+    }
+    return pid_max;
+}
+
+/**
+ * updateAllJobs with n jobs in the table: the idle call (no SIGCHLD) and the reaping of one finished job.
+ */
+static void benchUpdateJobs(JsonWriter& json, std::size_t n)
+{
+    std::shared_ptr<JobsList> jobs = SmallShell::getInstance().getJobsList();
+    CommandLine placeholder_line("sleep 1000 &");
+    pid_t first_pid = pidMax() + 1;
+    std::vector<int> placeholder_ids;
+    for(std::size_t i = 0; i + 1 < n; i++)
+    {
+        Command* cmd = new PlaceholderJob(placeholder_line, first_pid + i);
+        placeholder_ids.push_back(jobs->addJob(cmd)->job_id);
+        delete cmd;
+    }
+
+    std::vector<long long> idle_ns, reap_ns;
+    for(int i = 0; i < BENCH_REAP_ROUNDS; i++)
+    {
+        long long start = monotonicNs();
+        jobs->updateAllJobs();
+        idle_ns.push_back(monotonicNs() - start);
+
+        SmallShell::getInstance().executeCommand("true &"); // The n-th job
+        pid_t pid = jobs->getLastJob()->pid;
+        siginfo_t info;
+        waitid(P_PID, pid, &info, WEXITED | WNOWAIT); // A zombie now, but not reaped.
+        dispatchSignals(false);
+        JobsList::notifyChildChanged();
+        start = monotonicNs();
+        jobs->updateAllJobs();
+        reap_ns.push_back(monotonicNs() - start);
+    }
+
+    for(int job_id : placeholder_ids)
+    {
+        jobs->removeJob(job_id);
+    }
+    json.beginObject();
+    json.field("jobs", static_cast<long long>(n));
+    writeSummary(json, "idle_ns", idle_ns, 1);
+    writeSummary(json, "reap_one_ns", reap_ns, 1);
+    json.endObject();
+}
+
+/**
+ * How late "timeout <d> sleep 10" returns, in ms past its deadline.
+ */
+static void benchTimeout(JsonWriter& json)
+{
+    const long long durations_ms[] = {10, 50, 200};
+    json.beginArray("timeout_overshoot_ms");
+    for(long long duration_ms : durations_ms)
+    {
+        std::string cmd_line = "timeout " + std::to_string(duration_ms / 1000.0) + " sleep 10";
+        std::vector<long long> overshoot_ns;
+        for(long long ns : timeCommand(cmd_line, BENCH_TIMEOUT_ROUNDS))
+        {
+            overshoot_ns.push_back(ns - duration_ms * 1000000);
+        }
+        json.beginObject();
+        json.field("duration_ms", duration_ms);
+        writeSummary(json, "overshoot", overshoot_ns, 1e6);
+        json.endObject();
+    }
+    json.endArray();
+}
+
+static long long runSmashOnce(const std::string& smash_path, const std::string& line, int count)
+{
+    std::string script;
+    for(int i = 0; i < count; i++)
+    {
+        script += line + "\n";
+    }
+    const char* argv[] = {smash_path.c_str(), "-c", script.c_str(), NULL};
+    long long start = monotonicNs();
+    pid_t pid;
+    if(posix_spawn(&pid, smash_path.c_str(), NULL, NULL, const_cast<char* const*>(argv), environ) != 0)
+    {
+        return -1;
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    long long elapsed = monotonicNs() - start;
+    dispatchSignals(false);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0)? elapsed : -1;
+}
+
+/**
+ * Runs the smash binary with smash -c over count copies of line, BENCH_E2E_ROUNDS times.
+ * Returns the fastest wall time in ns (-1 on failure).
+ */
+static long long runSmash(const std::string& smash_path, const std::string& line, int count)
+{
+    long long best = -1;
+    for(int round = 0; round < BENCH_E2E_ROUNDS; round++)
+    {
+        long long elapsed = runSmashOnce(smash_path, line, count);
+        if(elapsed == -1)
+        {
+            return -1;
+        }
+        best = (best == -1 || elapsed < best)? elapsed : best;
+    }
+    return best;
+}
+
+/**
+ * Per-command latency of the binary: the wall time of iterations commands, less the startup of an empty run.
+ */
+static void benchEndToEnd(JsonWriter& json, const BenchConfig& config)
+{
+    json.beginObject("end_to_end_us");
+    long long startup = runSmash(config.smash_path, "", 0);
+    if(startup == -1)
+    {
+        json.field("error", "cannot run " + config.smash_path);
+        json.endObject();
+        return;
+    }
+    json.field("startup", startup / 1e3);
+    const char* const lines[] = {"showpid", "true"};
+    for(const char* line : lines)
+    {
+        long long total = runSmash(config.smash_path, line, config.iterations);
+        json.field(line, (total == -1)? -1 : (total - startup) / 1e3 / config.iterations);
+    }
+    json.endObject();
+}
+
+//*****************MAIN*****************//
+static bool parseArgs(int argc, char* argv[], BenchConfig& config)
+{
+    int opt;
+    while((opt = getopt(argc, argv, "n:m:r:d:b:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                config.iterations = atoi(optarg);
+                break;
+            case 'm':
+                config.file_mb = atoll(optarg);
+                break;
+            case 'r':
+                config.ballast_mb = atoll(optarg);
+                break;
+            case 'd':
+                config.dir = optarg;
+                break;
+            case 'b':
+                config.smash_path = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+    return config.iterations > 0 && config.file_mb > 0 && config.ballast_mb >= 0;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    if(!parseArgs(argc, argv, config))
+    {
+        std::cerr << "usage: smash_bench [-n iterations] [-m file MB] [-r ballast MB] [-d temp dir] [-b smash binary]" << std::endl;
+        return 1;
+    }
+    if(!startSpawnServer()) // Like smash: forked first, so the zygote backend can be measured too.
+    {
+        perror("smash_bench: the spawn server is not available");
+    }
+    initEventLoop(-1);
+    struct sigaction sa;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = signalNotifier;
+    sigaction(SIGALRM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // The commands' output (builtins through std::cout, children through fd 1) is thrown away, the report is not.
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(report_fd == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+    {
+        perror("smash_bench: cannot redirect stdout");
+        return 1;
+    }
+    close(null_fd);
+
+    std::ostringstream report;
+    JsonWriter json(report);
+    json.beginObject();
+    json.beginObject("config");
+    json.field("iterations", static_cast<long long>(config.iterations));
+    json.field("file_mb", config.file_mb);
+    json.field("ballast_mb", config.ballast_mb);
+    json.endObject();
+    benchParse(json);
+    benchLatency(json, config);
+    benchThroughput(json, config);
+    json.beginArray("update_all_jobs");
+    for(std::size_t n : {10, 100, 10000})
+    {
+        benchUpdateJobs(json, n);
+    }
+    json.endArray();
+    benchTimeout(json);
+    if(!config.smash_path.empty())
+    {
+        benchEndToEnd(json, config);
+    }
+    benchSpawn(json, config); // Last: it grows the RSS for good.
+    json.endObject();
+    report << '\n';
+    const std::string text = report.str();
+    if(write(report_fd, text.data(), text.size()) != static_cast<ssize_t>(text.size()))
+    {
+        perror("smash_bench: cannot write the report");
+        return 1;
+    }
+    return 0;
+}
@@ -2,33 +2,54 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include "signals.h"
 #include "Commands.h"
+#include "Spawn.h"
 
 using namespace std;
 
-void ctrlZHandler(int sig_num) // Stop signal
+// These run from the event loop (see EventLoop.h), not from signal context.
+
+/**
+ * Sends sig_num to every child of the foreground batch and prints verb for each, then ends the batch.
+ */
+static void signalFgBatch(int sig_num, const char* verb)
 {
-    int backup_errno = errno;
     SmallShell& smash = SmallShell::getInstance();
-    if(write(STDOUT_FILENO, "smash: got ctrl-Z\n", 18) == -1)
+    for(pid_t c_pid : *smash.getCurrentFgBatch())
     {
-        perror("smash error: write failed");
-        errno = backup_errno;
-        return;
+        JobEntry* jcb = smash.getJobsList()->getJobByPid(c_pid);
+        if(signalChild(c_pid, jcb? jcb->pidfd : -1, sig_num) == -1)
+        {
+            perror("smash error: kill failed");
+            continue;
+        }
+        std::cout << "smash: process " << c_pid << " was " << verb << std::endl;
+        if(jcb && sig_num == SIGSTOP)
+        {
+            jcb->start_time = time(NULL);
+            smash.getJobsList()->setJobState(jcb, j_state::STOPPED);
+        }
     }
-    smash.getJobsList()->updateAllJobs();
+    smash.setCurrentFgBatch(nullptr);
+}
+
+void ctrlZHandler() // Stop signal
+{
+    SmallShell& smash = SmallShell::getInstance();
+    std::cout << "smash: got ctrl-Z" << std::endl;
     int job_id = smash.getCurrentFgJobId();
     pid_t to_stop;
     if(job_id)
     {
         auto jcb = smash.getJobsList()->getJobById(job_id);
         to_stop = jcb->pid;
-        if(kill(to_stop, SIGSTOP) != -1)
+        if(signalChild(to_stop, jcb->pidfd, SIGSTOP) != -1)
         {
             std::cout << "smash: process " << to_stop << " was stopped" << std::endl;
             jcb->start_time = time(NULL);
-            jcb->state = j_state::STOPPED;
+            smash.getJobsList()->setJobState(jcb, j_state::STOPPED);
         }
         else
         {
@@ -48,20 +69,16 @@ void ctrlZHandler(int sig_num) // Stop signal
         }
         smash.setCurrentFg(0, 0);
     }
-    errno = backup_errno;
+    else if(smash.getCurrentFgBatch()) // parallel: stop all of its running children.
+    {
+        signalFgBatch(SIGSTOP, "stopped");
+    }
 }
 
-void ctrlCHandler(int sig_num) // Kill signal
+void ctrlCHandler() // Kill signal
 {
-    int backup_errno = errno;
     SmallShell& smash = SmallShell::getInstance();
-    if(write(STDOUT_FILENO, "smash: got ctrl-C\n", 18) == -1)
-    {
-        perror("smash error: write failed");
-        errno = backup_errno;
-        return;
-    }
-    smash.getJobsList()->updateAllJobs();
+    std::cout << "smash: got ctrl-C" << std::endl;
     pid_t to_kill;
     if(smash.getCurrentFgJobId())
     {
@@ -84,58 +101,59 @@ void ctrlCHandler(int sig_num) // Kill signal
         }
         smash.setCurrentFg(0, 0);
     }
-    errno = backup_errno;
+    else if(smash.getCurrentFgBatch()) // parallel: kill all of its running children.
+    {
+        signalFgBatch(SIGKILL, "killed");
+    }
 }
 
-void alarmHandler(int sig_num)
+void alarmHandler()
 {
-    int backup_errno = errno;
-    auto alarm_list = SmallShell::getInstance().getAlarmList();
-    time_t first_time = alarm_list->front().finish_time;
-    time_t curr_time = time(NULL);
     SmallShell& smash = SmallShell::getInstance();
-    int wait_ret = -2;
+    auto alarm_list = smash.getAlarmList();
     pid_t to_alarm;
-    std::shared_ptr<JobEntry> jcb = nullptr;
+    AlarmEntry acb;
 
     std::cout << "smash: got an alarm" << std::endl;
 
-    while((alarm_list->front().finish_time == first_time) || alarm_list->front().finish_time == curr_time)
+    while(alarm_list->popExpired(&acb)) // Handle every alarm whose deadline has passed.
     {
-        to_alarm = alarm_list->front().pid;
-        // = The process is still alive = not a zombie. (wait_ret == 0)
-        // Or, the process is not alive. It either just died, and was not polled yet (wait_ret > 0)
-        if((wait_ret = waitpid(to_alarm, NULL, WNOHANG)) >= 0) 
+        to_alarm = acb.pid;
+        // Check that the process is still running without reaping it, so whoever waits for it still gets its status:
+        // a pidfd turns readable once its process exits. Without a pidfd, peek with waitid(WNOWAIT).
+        // An exited process did not time out, it is reaped as usual.
+        bool running;
+        if(acb.pidfd != -1)
         {
-            if(kill(to_alarm, SIGKILL) != -1)
+            struct pollfd pfd = {acb.pidfd, POLLIN, 0};
+            running = (poll(&pfd, 1, 0) == 0);
+        }
+        else
+        {
+            siginfo_t info = {};
+            running = (waitid(P_PID, to_alarm, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0);
+        }
+        if(running)
+        {
+            if(signalChild(to_alarm, acb.pidfd, SIGKILL) != -1)
             {
-                std::cout << "smash: " << alarm_list->front().cmd_text << " timed out!" << std::endl;
-                if(wait_ret > 0)
-                {
-                    jcb = smash.getJobsList()->getJobByPid(alarm_list->front().pid);
-                    if(jcb)
-                    {
-                        smash.getJobsList()->removeJob(jcb->job_id);
-                    }
-                }
+                std::cout << "smash: " << *acb.cmd_text << " timed out!" << std::endl;
             }
             else
             {
                 perror("smash error: kill failed");
             }
         }
-        // else: The process was already reaped by another waitpid. Just print the alarm message for the pid and do not send sigkill.
-        
+        if(acb.pidfd != -1)
+        {
+            close(acb.pidfd);
+        }
         if(smash.getCurrentFgPid() == to_alarm)
         {
             smash.setCurrentFg(0, 0);
         }
-        alarm_list->pop_front();
     }
 
-    // Setup an alarm for the next process in the list.
-    time_t next_time = alarm_list->front().finish_time;
-    alarm(difftime(next_time, curr_time));
-
-    errno = backup_errno;
+    // Setup the timer for the next alarm in the list.
+    alarm_list->rearm();
 }
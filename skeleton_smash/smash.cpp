@@ -2,47 +2,109 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <memory>
 #include "Commands.h"
 #include "signals.h"
+#include "LineReader.h"
+#include "EventLoop.h"
+#include "Spawn.h"
+#include "SpawnServer.h"
 
 
 int main(int argc, char* argv[]) 
 {
-    struct sigaction sa_z, sa_c, sa_t;
+    // Forked first, while smash is still small and has no handlers installed.
+    if(getSpawnBackend() == SpawnBackend::Zygote && !startSpawnServer())
+    {
+        perror("smash error: failed to start the spawn server");
+        setSpawnBackend(SpawnBackend::PosixSpawn);
+    }
 
-    sa_z.sa_flags = SA_RESTART;
-    sigemptyset(&sa_z.sa_mask);
-    sa_z.sa_handler = ctrlZHandler;
+    // smash -c 'cmds' and smash <script> run without a prompt, reading the commands in blocks and
+    // flushing the output once per command. Otherwise commands are read from stdin with a prompt.
+    std::unique_ptr<LineReader> reader;
+    bool show_prompt = false;
+    if(argc > 2 && !std::string(argv[1]).compare("-c"))
+    {
+        reader.reset(new LineReader(std::string(argv[2])));
+    }
+    else if(argc > 1)
+    {
+        int script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if(script_fd == -1)
+        {
+            perror("smash error: open failed");
+            return 1;
+        }
+        reader.reset(new LineReader(script_fd));
+    }
+    else
+    {
+        reader.reset(new LineReader(STDIN_FILENO));
+        show_prompt = true;
+    }
+    if(!show_prompt)
+    {
+        std::ios::sync_with_stdio(false);
+    }
 
-    sa_c.sa_flags = SA_RESTART;
-    sigemptyset(&sa_c.sa_mask);
-    sa_c.sa_handler = ctrlCHandler;
+    int input_fd = reader->getFd();
+    try
+    {
+        initEventLoop(input_fd);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
-    sa_t.sa_flags = SA_RESTART;
-    sigemptyset(&sa_t.sa_mask);
-    sa_t.sa_handler = alarmHandler;
+    // Every handler only forwards its signal to the event loop.
+    struct sigaction sa;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = signalNotifier;
 
-    if(sigaction(SIGTSTP, &sa_z, NULL) == -1)
+    if(sigaction(SIGTSTP, &sa, NULL) == -1)
     {
         perror("smash error: failed to set ctrl-Z handler");
     }
-    if(sigaction(SIGINT, &sa_c, NULL) == -1)
+    if(sigaction(SIGINT, &sa, NULL) == -1)
     {
         perror("smash error: failed to set ctrl-C handler");
     }
-    if(sigaction(SIGALRM, &sa_t, NULL) == -1)
+    if(sigaction(SIGALRM, &sa, NULL) == -1)
     {
         perror("smash error: failed to set timeout handler");
     }
+    if(sigaction(SIGCHLD, &sa, NULL) == -1)
+    {
+        perror("smash error: failed to set child handler");
+    }
 
     SmallShell& smash = SmallShell::getInstance();
+    std::string cmd_line;
     while(!smash.getQuitFlag()) 
     {
-        std::cout << smash.getPrompt() << "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
+        if(show_prompt)
+        {
+            std::cout << smash.getPrompt() << "> ";
+        }
+        std::cout.flush(); // The command boundary: the previous command's output (and the prompt) go out together.
         try
         {
+            // Signals that arrived during the last command (finished jobs, alarms) are handled even when the next
+            // line is already buffered and smash never blocks for input.
+            dispatchSignals(true);
+            if(!reader->hasBuffered())
+            {
+                waitForInput(); // Handles the signals that arrive while smash is idle.
+            }
+            if(!reader->nextLine(cmd_line)) // EOF
+            {
+                break;
+            }
             smash.executeCommand(cmd_line.c_str());
         }
         catch(const std::exception& e)
@@ -50,5 +112,6 @@ int main(int argc, char* argv[])
             std::cerr << e.what() << std::endl;
         }
     }
+    std::cout.flush();
     return 0;
-}
\ No newline at end of file
+}